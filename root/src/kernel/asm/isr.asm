@@ -52,6 +52,7 @@ global pic0_generic
 global pic1_generic
 global apic_nmi
 global apic_spurious
+global apic_timer
 
 extern pit_handler
 extern pic0_generic_handler
@@ -62,14 +63,13 @@ extern apic_spurious_handler
 ; IPIs
 global ipi_abort
 global ipi_resched
-global ipi_abortexec
+global ipi_tlb
+extern tlb_shootdown_handler
 
 ; Misc.
 extern dummy_int_handler
 global int_handler
-extern task_resched_bsp
-extern task_resched
-extern task_trigger_resched
+extern task_preempt
 global syscall_entry
 extern kbd_handler
 
@@ -192,7 +192,20 @@ exc_ss_fault_handler:
 exc_gpf_handler:
     except_handler_err_code gpf_handler
 exc_page_fault_handler:
-    except_handler_err_code page_fault_handler
+    ; Page faults can be resolved, so unlike the other exceptions this one
+    ; preserves the registers and returns to the faulting instruction.
+    pusham
+
+    mov rdi, qword [rsp+15*8+16]
+    mov rsi, qword [rsp+15*8+8]
+    mov rdx, qword [rsp+15*8]
+
+    call page_fault_handler
+
+    popam
+    add rsp, 8
+
+    iretq
 exc_x87_fp_handler:
     except_handler x87_fp_handler
 exc_alignment_check_handler:
@@ -212,39 +225,28 @@ irq0_handler:
 
     call pit_handler
 
-    mov rdi, rsp
-
-    call task_resched_bsp
-
     call lapic_eoi
 
     popam
     iretq
 
-ipi_abortexec:
-    mov rsp, qword [gs:0008]
-    call lapic_eoi
-    sti
-  .wait:
-    hlt
-    jmp .wait
+ipi_tlb:
+    common_handler tlb_shootdown_handler
 
+; The local APIC timer and IPI_RESCHED preempt the running thread, and
+; only return if the scheduler is locked
+apic_timer:
 ipi_resched:
     pusham
 
     mov rdi, rsp
 
-    mov rax, qword [gs:0000]
-    test rax, rax
-    jz .is_bsp
-    call task_resched
-  .is_bsp:
-    call task_trigger_resched
+    call task_preempt
 
-    ; ** EXECUTION SHOULD NEVER REACH THIS POINT **
-  .halt:
-    hlt
-    jmp .halt
+    call lapic_eoi
+
+    popam
+    iretq
 
 invalid_syscall:
     mov rax, -1
@@ -272,6 +274,30 @@ syscall_table:
     dq syscall_alloc_at ;6
     extern syscall_set_fs_base
     dq syscall_set_fs_base ;7
+    extern syscall_mmap
+    dq syscall_mmap ;8
+    extern syscall_munmap
+    dq syscall_munmap ;9
+    extern syscall_mprotect
+    dq syscall_mprotect ;10
+    extern syscall_fork
+    dq syscall_fork ;11
+    extern syscall_vm_stats
+    dq syscall_vm_stats ;12
+    extern syscall_shm_open
+    dq syscall_shm_open ;13
+    extern syscall_shm_map
+    dq syscall_shm_map ;14
+    extern syscall_shm_close
+    dq syscall_shm_close ;15
+    extern syscall_exit
+    dq syscall_exit ;16
+    extern syscall_setpriority
+    dq syscall_setpriority ;17
+    extern syscall_sched_setaffinity
+    dq syscall_sched_setaffinity ;18
+    extern syscall_sched_getaffinity
+    dq syscall_sched_getaffinity ;19
     dq invalid_syscall
   .end:
 
@@ -64,10 +64,11 @@ smp_init_cpu0_local:
     mov edx, edi
     wrmsr
 
-    ; enable SSE
+    ; enable SSE, and make ring 0 writes honour read-only pages (copy-on-write)
     mov rax, cr0
     and al, 0xfb
     or al, 0x02
+    or eax, 1 << 16
     mov cr0, rax
     mov rax, cr4
     or ax, 3 << 9
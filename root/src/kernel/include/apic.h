@@ -6,11 +6,17 @@
 
 #define APICREG_ICR0 0x300
 #define APICREG_ICR1 0x310
+#define APICREG_LVT_TIMER 0x320
+#define APICREG_TIMER_INITIAL 0x380
+#define APICREG_TIMER_CURRENT 0x390
+#define APICREG_TIMER_DIVIDE 0x3e0
 
 #define IPI_BASE 0x40
 #define IPI_RESCHED (IPI_BASE + 1)
 #define IPI_ABORT (IPI_BASE + 0)
 
+#define APIC_TIMER_VECTOR 0x48
+
 int apic_supported(void);
 
 uint32_t lapic_read(uint32_t);
@@ -19,6 +25,9 @@ void lapic_set_nmi(uint8_t, uint16_t, uint8_t);
 void lapic_enable(void);
 void lapic_eoi(void);
 void lapic_send_ipi(uint8_t, uint8_t);
+void lapic_send_self_ipi(uint8_t);
+void lapic_timer_calibrate(void);
+void lapic_timer_oneshot(uint64_t);
 
 uint32_t io_apic_read(size_t, uint32_t);
 void io_apic_write(size_t, uint32_t, uint32_t);
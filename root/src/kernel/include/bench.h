@@ -0,0 +1,14 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+
+#define rdtsc() ({ \
+    uint32_t lo, hi; \
+    asm volatile ("rdtsc;" : "=a" (lo), "=d" (hi)); \
+    ((uint64_t)hi << 32) | lo; \
+})
+
+int bench_enabled(const char *);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef __CPUMASK_H__
+#define __CPUMASK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAX_CPUS 128
+
+/* A set of CPUs, bit N standing for CPU number N */
+struct cpumask_t {
+    uint64_t bits[MAX_CPUS / 64];
+};
+
+#define cpumask_test(MASK, CPU) ({ \
+    (int)(((MASK)->bits[(CPU) / 64] >> ((CPU) % 64)) & 1); \
+})
+
+#define cpumask_set(MASK, CPU) ({ \
+    (MASK)->bits[(CPU) / 64] |= (uint64_t)1 << ((CPU) % 64); \
+})
+
+#define cpumask_fill(MASK) ({ \
+    for (size_t cpumask_i = 0; cpumask_i < MAX_CPUS / 64; cpumask_i++) \
+        (MASK)->bits[cpumask_i] = (uint64_t)-1; \
+})
+
+#endif
@@ -10,6 +10,11 @@
 #define PT_INTERP   0x00000003
 #define PT_PHDR     0x00000006
 
+/* Segment permissions */
+#define PF_X        0x1
+#define PF_W        0x2
+#define PF_R        0x4
+
 #define ABI_SYSV 0x00
 #define ARCH_X86_64 0x3e
 #define BITS_LE 0x01
@@ -61,6 +66,6 @@ struct elf_shdr_t {
     uint64_t sh_entsize;
 };
 
-int elf_load(int, struct pagemap_t *, size_t, struct auxval_t *, char **);
+int elf_load(const char *, struct pagemap_t *, size_t, struct auxval_t *, char **);
 
 #endif
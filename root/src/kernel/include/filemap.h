@@ -0,0 +1,34 @@
+#ifndef __FILEMAP_H__
+#define __FILEMAP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <lock.h>
+
+#define FILEMAP_PATH_MAX 256
+
+/* The pages of a file which were read so far, shared by every mapping of
+ * the file. Entries are kept for as long as the kernel runs. The cache is
+ * read-only: writes to the file after a page was read are not seen by it,
+ * which is fine for the executables it is used for. */
+struct filemap_t {
+    char path[FILEMAP_PATH_MAX];
+    int fd;
+    size_t size;
+    size_t page_count;
+    /* Physical address of each page of the file, 0 if not read yet */
+    size_t *pages;
+    /* Guards `pages`, held with interrupts disabled as the page fault
+     * handler looks pages up */
+    lock_t lock;
+    /* Serialises reads from `fd`, held with interrupts enabled */
+    lock_t io_lock;
+    struct filemap_t *next;
+};
+
+struct filemap_t *filemap_open(const char *);
+void *filemap_page(struct filemap_t *, size_t);
+void *filemap_lookup(struct filemap_t *, size_t);
+int filemap_read(struct filemap_t *, void *, size_t, size_t);
+
+#endif
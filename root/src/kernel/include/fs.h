@@ -34,6 +34,8 @@ struct vfs_handle_t {
     int used;
     int fs;
     int intern_fd;
+    /* Processes sharing the descriptor, see vfs_dup() */
+    int refcount;
 };
 
 struct mnt_t {
@@ -82,6 +84,7 @@ int lseek(int, off_t, int);
 int vfs_get_mountpoint(const char *, char **);
 void vfs_get_absolute_path(char *, const char *, const char *);
 int vfs_install_fs(struct fs_t);
+int vfs_dup(int);
 void init_vfs(void);
 
 void init_devfs(void);
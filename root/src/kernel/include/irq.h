@@ -8,6 +8,7 @@ void pic0_generic(void);
 void pic1_generic(void);
 void apic_nmi(void);
 void apic_spurious(void);
+void apic_timer(void);
 
 void dummy_int_handler(void);
 void pit_handler(void);
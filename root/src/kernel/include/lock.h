@@ -60,4 +60,28 @@ typedef volatile int64_t lock_t;
     ); \
 })
 
+/* Disable interrupts on this CPU, returning the previous rflags */
+#define interrupts_save() ({ \
+    uint64_t rflags; \
+    asm volatile ( \
+        "pushfq;" \
+        "pop rax;" \
+        "cli;" \
+        : "=a" (rflags) \
+        : \
+        : "memory" \
+    ); \
+    rflags; \
+})
+
+#define interrupts_restore(rflags) ({ \
+    asm volatile ( \
+        "push rax;" \
+        "popfq;" \
+        : \
+        : "a" (rflags) \
+        : "memory", "cc" \
+    ); \
+})
+
 #endif
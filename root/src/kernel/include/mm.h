@@ -6,30 +6,102 @@
 #include <lock.h>
 
 #define PAGE_SIZE ((size_t)4096)
+#define LARGE_PAGE_SIZE ((size_t)0x200000)
 
 #define PAGE_TABLE_ENTRIES 512
+
+/* Per-CPU free page cache, refilled from and drained to the buddy
+ * allocator PMM_CACHE_BATCH pages at a time */
+#define PMM_CACHE_SIZE 64
+#define PMM_CACHE_BATCH 32
+
 #define KERNEL_PHYS_OFFSET ((size_t)0xffffffffc0000000)
 #define MEM_PHYS_OFFSET ((size_t)0xffff800000000000)
 
 typedef uint64_t pt_entry_t;
 
+struct vma_t;
+
+/* The page fault handler takes both locks with interrupts disabled, so
+ * they are never held with interrupts enabled: a holder preempted on the
+ * CPU of a faulting thread would never be let go of. */
 struct pagemap_t {
     pt_entry_t *pml4;
     lock_t lock;
+    /* Bumped whenever lower half mappings are removed or lose rights,
+     * see tlb.c */
+    volatile size_t tlb_gen;
+    /* Areas of the lower half a process may use, see vma.c */
+    struct vma_t *vmas;
+    lock_t vma_lock;
 };
 
 extern struct pagemap_t kernel_pagemap;
 extern pt_entry_t kernel_cr3;
 
+/* Metadata of a page frame, see pmm.c. There is one for every page of
+ * usable memory, so it is kept to a few bytes. */
+struct page_t {
+    /* Owners of the page: whoever allocated it, plus a reference taken
+     * with pmm_ref() for every other user, such as a copy-on-write mapping */
+    volatile uint32_t refcount;
+    /* Page table entries mapping the page */
+    volatile uint32_t mapcount;
+    uint16_t flags;
+    /* What the page belongs to, depending on the flags */
+    uint16_t owner;
+};
+
+/* struct page_t flags */
+/* Backs anonymous user memory */
+#define PG_ANON (1 << 0)
+/* Belongs to the shared memory segment `owner`, see shm.c */
+#define PG_SHM (1 << 1)
+/* Caches a page of a file, see filemap.c */
+#define PG_FILE (1 << 2)
+
+/* pmm_alloc_flags() flags */
+#define PMM_NOZERO (1 << 0)
+
 void *pmm_alloc(size_t);
+void *pmm_alloc_flags(size_t, int);
+void pmm_zero_idle(void);
 void pmm_free(void *, size_t);
+void pmm_free_batch(size_t *, size_t);
+struct page_t *pmm_page(size_t);
+void pmm_ref(void *);
+int pmm_unref(void *);
+int pmm_shared(void *);
+void pmm_mapcount_add(size_t, int);
 void init_pmm(void);
+void init_pmm_buddy(void);
+void pmm_bench(void);
 
+int map_range(struct pagemap_t *, size_t, size_t, size_t, size_t);
+int unmap_range(struct pagemap_t *, size_t, size_t);
+int protect_range(struct pagemap_t *, size_t, size_t, size_t);
+int release_range(struct pagemap_t *, size_t, size_t);
+int vmm_back_page(struct pagemap_t *, size_t, size_t);
+int vmm_back_page_copy(struct pagemap_t *, size_t, size_t, const void *, size_t);
+int vmm_map_cow_page(struct pagemap_t *, size_t, size_t, size_t);
+int vmm_back_large_page(struct pagemap_t *, size_t, size_t);
+void vmm_stats(struct pagemap_t *, size_t *, size_t *);
+int vmm_share_range(struct pagemap_t *, struct pagemap_t *, size_t, size_t, int);
+int vmm_break_cow(struct pagemap_t *, size_t, size_t);
+struct pagemap_t *new_pagemap(void);
+void free_pagemap(struct pagemap_t *);
 int map_page(struct pagemap_t *, size_t, size_t, size_t);
 int unmap_page(struct pagemap_t *, size_t);
 int remap_page(struct pagemap_t *, size_t, size_t);
+size_t virt_to_phys(struct pagemap_t *, size_t);
 void init_vmm(void);
 
+void *vmalloc(size_t);
+void *vrealloc(void *, size_t);
+void vfree(void *);
+size_t vmalloc_size(void *);
+void init_vmalloc(void);
+
 #define invlpg(addr) ({ \
     asm volatile ( \
         "invlpg [rbx];" \
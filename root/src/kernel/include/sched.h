@@ -0,0 +1,69 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <lock.h>
+
+/* How often a CPU retries while the scheduler is locked */
+#define SCHED_TIMESLICE_MS 5
+
+/* The period over which every runnable thread of a CPU gets to run, and
+ * the shortest a thread runs before being preempted */
+#define SCHED_LATENCY_MS 20
+#define SCHED_MIN_GRANULARITY_MS 1
+
+/* Range of process_t.priority, lower runs more */
+#define SCHED_PRIO_MIN (-20)
+#define SCHED_PRIO_MAX 19
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct thread_t;
+struct cpumask_t;
+
+/* Sleeping threads, by deadline in milliseconds of uptime. The slots of
+ * level L each span 64^L ms, and hold the deadlines up to 63 slots after
+ * the one `now` is in. As time advances, the slots of the upper levels are
+ * spread over the lower ones, and level 0 slots expire. The bitmaps tell
+ * which slots are in use. */
+struct timer_wheel_t {
+    uint64_t now;
+    uint64_t bitmap[WHEEL_LEVELS];
+    struct thread_t *slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+/* The threads of a CPU: the runnable ones in a tree by vruntime, the
+ * sleeping ones, and the one running. The lock protects the queue and the
+ * wheel, and the state of every thread on them. */
+struct run_queue_t {
+    lock_t lock;
+    struct thread_t *root;
+    size_t nr_runnable;
+    /* Total weight of the runnable threads */
+    uint64_t load;
+    /* The least vruntime of the threads, never decreasing */
+    uint64_t min_vruntime;
+    struct timer_wheel_t wheel;
+    struct thread_t *current;
+    /* When to next look for a longer queue to pull threads from */
+    uint64_t next_balance;
+    /* Threads pulled from other CPUs, and how many of these were stolen
+     * because this CPU had nothing to run */
+    size_t nr_migrations;
+    size_t nr_steals;
+};
+
+void sched_init_cpu(int);
+void sched_add(struct thread_t *);
+void sched_set_priority(struct thread_t *, int);
+void sched_set_affinity(struct thread_t *, const struct cpumask_t *);
+void sched_kill(struct thread_t *);
+void sched_exit(void);
+struct thread_t *sched_switch(void);
+void sched_report(void);
+void sched_bench(void);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mm.h>
+
+#define SHM_MAX_SEGMENTS 256
+#define SHM_NAME_MAX 64
+
+/* shm_open() flags */
+#define SHM_CREATE (1 << 0)
+
+int shm_open(const char *, size_t, int);
+size_t shm_map(struct pagemap_t *, int, size_t, int);
+int shm_dup(int);
+int shm_close(int);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mm.h>
+
+/* Largest size served by the kalloc() size classes */
+#define SLAB_MAX_SIZE 2048
+
+/* Every slab is a single page starting with its header, so slab objects
+ * are never page aligned, while page sized kalloc()s always are. */
+#define is_slab_object(PTR) ((size_t)(PTR) % PAGE_SIZE)
+
+struct slab_cache_t;
+
+struct slab_cache_t *slab_cache_create(const char *, size_t);
+void *slab_alloc(struct slab_cache_t *);
+void slab_free(void *);
+size_t slab_object_size(void *);
+
+void *slab_kalloc(size_t);
+void slab_report(void);
+void init_slab(void);
+
+#endif
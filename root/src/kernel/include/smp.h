@@ -4,8 +4,10 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <task.h>
-
-#define MAX_CPUS 128
+#include <mm.h>
+#include <tlb.h>
+#include <sched.h>
+#include <cpumask.h>
 
 #define current_cpu ({ \
     int cpu_number; \
@@ -25,12 +27,29 @@ struct cpu_local_t {
     pid_t current_process;
     tid_t current_thread;
     uint8_t lapic_id;
-};
+    /* Free pages owned by this CPU, see pmm.c */
+    size_t pmm_cache_count;
+    size_t pmm_cache[PMM_CACHE_SIZE];
+    /* Page being zeroed by this CPU while idle */
+    size_t pmm_zero_page;
+    /* Address space currently loaded in CR3 */
+    struct pagemap_t *active_pagemap;
+    /* Invalidations other CPUs asked this CPU to perform, see tlb.c */
+    struct tlb_queue_t tlb_queue;
+    /* PCID assignments, and the next one to recycle */
+    struct tlb_pcid_t pcids[TLB_PCID_COUNT];
+    size_t pcid_next;
+    /* Threads scheduled on this CPU, see sched.c */
+    struct run_queue_t run_queue;
+    /* When the local APIC timer is set to fire, 0 if it is not */
+    uint64_t timer_deadline;
+} __attribute__((aligned(64)));
 
 extern struct cpu_local_t cpu_locals[MAX_CPUS];
 
 void init_smp(void);
 
 extern int smp_cpu_count;
+extern int cpu_locals_ready;
 
 #endif
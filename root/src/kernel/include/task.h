@@ -5,11 +5,13 @@
 #include <stddef.h>
 #include <mm.h>
 #include <lock.h>
+#include <cpumask.h>
 
 #define MAX_PROCESSES 65536
 #define MAX_THREADS 1024
 #define MAX_TASKS (MAX_PROCESSES*16)
 #define MAX_FILE_HANDLES 256
+#define MAX_SHM_HANDLES 64
 
 #define CURRENT_PROCESS cpu_locals[current_cpu].current_process
 #define CURRENT_THREAD cpu_locals[current_cpu].current_thread
@@ -63,12 +65,45 @@ typedef int32_t tid_t;
 typedef int32_t uid_t;
 typedef int32_t gid_t;
 
+/* struct thread_t states, see sched.c */
+#define TASK_RUNNABLE 0
+#define TASK_RUNNING 1
+#define TASK_SLEEPING 2
+#define TASK_DEAD 3
+
 struct thread_t {
     tid_t tid;
+    /* Index in the task table */
+    tid_t task_id;
     pid_t process;
-    lock_t lock;
     uint64_t yield_target;
-    int active_on_cpu;
+    /* Scheduling state, and the CPU whose run queue the thread is on */
+    int state;
+    int cpu;
+    /* Set once the thread is killed, see sched_kill() */
+    int exiting;
+    /* Run time in microseconds scaled by weight, see sched.c, and when
+     * the thread last started running */
+    uint64_t vruntime;
+    uint64_t weight;
+    uint64_t exec_start;
+    /* Time run for in microseconds, unscaled */
+    uint64_t runtime;
+    /* Links in the run queue tree while runnable */
+    struct thread_t *left;
+    struct thread_t *right;
+    int height;
+    /* Links in the timer wheel while sleeping, `next` also links the dead
+     * threads waiting for the reaper */
+    struct thread_t *next;
+    struct thread_t *prev;
+    /* CPUs the thread may run on */
+    struct cpumask_t affinity;
+    /* uptime_raw when the thread was last switched away from */
+    uint64_t last_ran;
+    /* Where the thread sleeps in the timer wheel of its CPU */
+    int wheel_level;
+    int wheel_slot;
     size_t kstack;
     size_t ustack;
     size_t fs_base;
@@ -86,10 +121,18 @@ struct auxval_t {
 struct process_t {
     pid_t pid;
     int priority;
+    /* Set once the process is killed, it is freed along with its last
+     * thread */
+    int exiting;
+    /* CPUs new threads of the process may run on */
+    struct cpumask_t affinity;
     struct pagemap_t *pagemap;
     struct thread_t **threads;
     char *cwd;
     int *file_handles;
+    /* Ids of the shared memory segments the process has open, -1 for the
+     * unused handles, see shm.c */
+    int *shm_handles;
     size_t cur_brk;
     struct auxval_t auxval;
 };
@@ -101,10 +144,19 @@ extern struct thread_t **task_table;
 
 void init_sched(void);
 
+int task_sleep_until(uint64_t);
 void yield(uint64_t);
 
 tid_t task_tcreate(pid_t, void *(*)(void *), void *);
 pid_t task_pcreate(struct pagemap_t *);
+pid_t task_pfork(struct ctx_t *);
 int task_tkill(pid_t, tid_t);
+int task_pkill(pid_t);
+void task_texit(void);
+void task_pexit(void);
+void task_reap(struct thread_t *);
+int task_setpriority(pid_t, int);
+int task_setaffinity(pid_t, tid_t, const struct cpumask_t *);
+int task_getaffinity(pid_t, tid_t, struct cpumask_t *);
 
 #endif
@@ -15,8 +15,17 @@ struct s_time_t {
 
 void bios_get_time(struct s_time_t *);
 
-extern volatile uint64_t uptime_raw;
-extern volatile uint64_t uptime_sec;
+extern volatile uint64_t pit_uptime;
+
+uint64_t uptime_us(void);
+
+/* Milliseconds and seconds since boot */
+#define uptime_raw (uptime_us() / 1000)
+#define uptime_sec (uptime_us() / 1000000)
+
+void time_use_tsc(uint64_t);
+void timer_set(uint64_t);
+void timer_arm(uint64_t);
 
 void ksleep(uint64_t);
 
@@ -0,0 +1,59 @@
+#ifndef __TLB_H__
+#define __TLB_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mm.h>
+#include <lock.h>
+
+/* Ranges larger than this are flushed by reloading CR3 instead of
+ * with an invlpg per page */
+#define TLB_FLUSH_THRESHOLD 32
+
+/* Ranges a CPU can have pending before it falls back to a full flush */
+#define TLB_QUEUE_SIZE 16
+
+/* PCIDs handed out by each CPU. PCID 0 starts out as the kernel pagemap's */
+#define TLB_PCID_COUNT 8
+
+/* The pagemap a CPU assigned a PCID to, and its generation when the TLB
+ * entries tagged with that PCID were last known to be current */
+struct tlb_pcid_t {
+    struct pagemap_t *pagemap;
+    size_t gen;
+};
+
+struct tlb_request_t {
+    size_t virt_addr;
+    size_t pages;
+};
+
+/* Per-CPU queue of pending invalidations, drained by the IPI_TLB handler */
+struct tlb_queue_t {
+    lock_t lock;
+    volatile int ipi_pending;
+    int flush_all;
+    size_t count;
+    struct tlb_request_t requests[TLB_QUEUE_SIZE];
+    /* Requests queued to and completed by this CPU so far */
+    size_t queued;
+    volatile size_t completed;
+};
+
+extern lock_t tlb_shootdowns_sent;
+extern lock_t tlb_shootdowns_avoided;
+
+/* Set on the higher half mappings when global pages are supported */
+extern pt_entry_t tlb_global_flag;
+
+size_t tlb_new_generation(void);
+void tlb_invalidate(struct pagemap_t *, size_t, size_t);
+size_t tlb_switch_cr3(struct pagemap_t *);
+void tlb_shootdown_handler(void);
+void tlb_spinlock_acquire(lock_t *);
+void tlb_serve_pending(void);
+void tlb_report(void);
+void init_tlb(void);
+void init_tlb_cpu(void);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef __VMA_H__
+#define __VMA_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mm.h>
+#include <filemap.h>
+
+#define PROT_NONE 0
+#define PROT_READ (1 << 0)
+#define PROT_WRITE (1 << 1)
+#define PROT_EXEC (1 << 2)
+
+/* mmap() places mappings it is not given an address for from MMAP_BASE up.
+ * User mappings end at USER_SPACE_TOP, the kernel stacks of the threads
+ * live above it. */
+#define MMAP_BASE ((size_t)0x0000600000000000)
+#define USER_SPACE_TOP ((size_t)0x00007f0000000000)
+
+/* struct vma_t flags */
+/* Maps pages of a shared memory segment, mapped up front and shared rather
+ * than copied on fork */
+#define VMA_SHARED (1 << 0)
+/* Maps a file, see vma_map_file() */
+#define VMA_FILE (1 << 1)
+
+/* A page aligned range [base, end) of a process' address space, whose pages
+ * are backed by zeroed ones when first touched, or by the pages of a file
+ * for the areas which map one. The areas of a pagemap never overlap, and
+ * are kept in an AVL tree sorted by base address. */
+struct vma_t {
+    size_t base;
+    size_t end;
+    int prot;
+    int flags;
+    /* The file mapped, if any, and the offset in it which base maps */
+    struct filemap_t *file;
+    size_t offset;
+    /* Where the contents of the file end, the rest of the page they end
+     * in reads as zeroes */
+    size_t file_end;
+    int height;
+    struct vma_t *left;
+    struct vma_t *right;
+};
+
+void init_vma(void);
+int vma_map(struct pagemap_t *, size_t, size_t, int);
+size_t vma_map_anywhere(struct pagemap_t *, size_t, size_t, int);
+int vma_map_file(struct pagemap_t *, size_t, size_t, int, struct filemap_t *, size_t, size_t);
+size_t vma_map_shared(struct pagemap_t *, size_t, size_t *, size_t, int);
+int vma_unmap(struct pagemap_t *, size_t, size_t);
+int vma_protect(struct pagemap_t *, size_t, size_t, int);
+int vma_handle_fault(struct pagemap_t *, size_t, size_t);
+int vma_fork(struct pagemap_t *, struct pagemap_t *);
+void vma_destroy(struct pagemap_t *);
+void vma_fork_bench(void);
+void vma_teardown_bench(void);
+
+#endif
@@ -5,9 +5,21 @@
 #include <cpuid.h>
 #include <acpi/madt.h>
 #include <mm.h>
+#include <time.h>
+#include <bench.h>
 
 #define APIC_CPUID_BIT (1 << 9)
 
+#define LAPIC_TIMER_MASKED (1 << 16)
+#define LAPIC_TIMER_DIV16 0x3
+
+/* How long lapic_timer_calibrate() counts for, in PIT milliseconds */
+#define LAPIC_CALIBRATION_MS 50
+
+/* Timer ticks per millisecond. The timers of all the CPUs are assumed to
+ * run at the same rate as the BSP's. */
+static uint32_t lapic_timer_freq = 0;
+
 int apic_supported(void) {
     unsigned int eax, ebx, ecx, edx = 0;
 
@@ -73,6 +85,56 @@ void lapic_send_ipi(uint8_t vector, uint8_t target_id) {
     return;
 }
 
+void lapic_send_self_ipi(uint8_t vector) {
+    lapic_write(APICREG_ICR0, 0x44000 | vector);
+    return;
+}
+
+/* Measure the rate of the timer, and of the TSC, against the PIT, then
+ * let the TSC keep time. Interrupts should be ON and the PIT running. */
+void lapic_timer_calibrate(void) {
+    lapic_write(APICREG_TIMER_DIVIDE, LAPIC_TIMER_DIV16);
+    lapic_write(APICREG_LVT_TIMER, LAPIC_TIMER_MASKED);
+
+    /* Count between two PIT ticks, so that both ends are taken with the
+     * same interrupt latency */
+    uint64_t start = pit_uptime;
+    while (pit_uptime == start)
+        asm volatile ("hlt");
+    start = pit_uptime;
+
+    lapic_write(APICREG_TIMER_INITIAL, 0xffffffff);
+    uint64_t tsc = rdtsc();
+    while (pit_uptime < start + LAPIC_CALIBRATION_MS)
+        asm volatile ("hlt");
+    uint32_t ticks = 0xffffffff - lapic_read(APICREG_TIMER_CURRENT);
+    tsc = rdtsc() - tsc;
+    lapic_write(APICREG_TIMER_INITIAL, 0);
+
+    lapic_timer_freq = ticks / LAPIC_CALIBRATION_MS;
+
+    kprint(KPRN_INFO, "apic: Timer runs at %u ticks per ms", lapic_timer_freq);
+
+    time_use_tsc(tsc / LAPIC_CALIBRATION_MS);
+}
+
+/* Interrupt the calling CPU once, in `us` microseconds, or cancel the
+ * pending interrupt if 0 */
+void lapic_timer_oneshot(uint64_t us) {
+    uint64_t count = 0;
+
+    if (us) {
+        count = us * lapic_timer_freq / 1000 + 1;
+        /* Fire early rather than never, the deadline is checked again */
+        if (count > 0xffffffff)
+            count = 0xffffffff;
+    }
+
+    lapic_write(APICREG_TIMER_DIVIDE, LAPIC_TIMER_DIV16);
+    lapic_write(APICREG_LVT_TIMER, APIC_TIMER_VECTOR);
+    lapic_write(APICREG_TIMER_INITIAL, (uint32_t)count);
+}
+
 /* Read from the `io_apic_num`'th I/O APIC as described by the MADT */
 uint32_t io_apic_read(size_t io_apic_num, uint32_t reg) {
     volatile uint32_t *base = (volatile uint32_t *)((size_t)madt_io_apics[io_apic_num]->addr + MEM_PHYS_OFFSET);
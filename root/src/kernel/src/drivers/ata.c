@@ -6,6 +6,7 @@
 #include <klib.h>
 #include <dev.h>
 #include <ata.h>
+#include <slab.h>
 
 #define DEVICE_COUNT 4
 #define BYTES_PER_SECT 512
@@ -71,6 +72,8 @@ static int ata_flush_ext(int disk);
 
 static ata_device devices[DEVICE_COUNT];
 
+static struct slab_cache_t *sector_cache;
+
 static int find_sect(int drive, uint64_t sect) {
     for (size_t i = 0; i < MAX_CACHED_SECTORS; i++)
         if ((devices[drive].cache[i].sector == sect)
@@ -111,7 +114,7 @@ static int cache_sect(int drive, int sect) {
 
 fnd:
     /* Allocate some cache for this device */
-    devices[drive].cache[targ].cache = kalloc(BYTES_PER_SECT);
+    devices[drive].cache[targ].cache = slab_alloc(sector_cache);
 
 notfnd:
 
@@ -247,6 +250,8 @@ static int ata_flush1(int device) {
 void init_ata(void) {
     kprint(KPRN_INFO, "ata: Initialising ata device driver...");
 
+    sector_cache = slab_cache_create("ata_sector", BYTES_PER_SECT);
+
     int j = 0;
     int master = 1;
     for (int i = 0; i < DEVICE_COUNT; i++) {
@@ -3,22 +3,78 @@
 #include <task.h>
 #include <fs.h>
 #include <mm.h>
+#include <vma.h>
+#include <filemap.h>
 #include <panic.h>
 
-/* Execute an ELF file given some file data
+#define page_round_up(LEN) (((LEN) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+static int segment_prot(struct elf_phdr_t *phdr) {
+    int prot = PROT_NONE;
+
+    if (phdr->p_flags & PF_R)
+        prot |= PROT_READ;
+    if (phdr->p_flags & PF_W)
+        prot |= PROT_WRITE;
+    if (phdr->p_flags & PF_X)
+        prot |= PROT_EXEC;
+
+    return prot;
+}
+
+/* Map a PT_LOAD segment. The part read from the file maps the file cache,
+ * so that the file is only read once and the pages which are not written
+ * to are shared by every process running the file. The rest of the segment
+ * is anonymous memory. */
+static int map_segment(struct pagemap_t *pagemap, size_t base, struct filemap_t *file,
+                       struct elf_phdr_t *phdr) {
+    size_t seg_start = phdr->p_vaddr & (PAGE_SIZE - 1);
+    size_t virt = base + phdr->p_vaddr - seg_start;
+    size_t file_len = page_round_up(seg_start + phdr->p_filesz);
+    size_t mem_len = page_round_up(seg_start + phdr->p_memsz);
+    int prot = segment_prot(phdr);
+
+    /* File pages can only be mapped if the segment is aligned like them */
+    if ((phdr->p_offset & (PAGE_SIZE - 1)) != seg_start)
+        return -1;
+    if (phdr->p_filesz > phdr->p_memsz)
+        return -1;
+
+    if (phdr->p_filesz) {
+        /* The start of the bss in the last file page has to read as zeroes */
+        size_t file_end = virt + file_len;
+        if (phdr->p_memsz > phdr->p_filesz)
+            file_end = base + phdr->p_vaddr + phdr->p_filesz;
+
+        /* This fails for segments sharing a page, which are not supported */
+        if (vma_map_file(pagemap, virt, file_len, prot, file,
+                         phdr->p_offset - seg_start, file_end))
+            return -1;
+    }
+
+    if (mem_len > file_len) {
+        if (vma_map(pagemap, virt + file_len, mem_len - file_len, prot))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Map the ELF file at `path` into `pagemap`. Its pages are read into the
+   file cache, and mapped from it when first touched.
    out_ld_path: If non-null, returns path of the dynamic linker as kalloc()ed string */
-int elf_load(int fd, struct pagemap_t *pagemap, size_t base, struct auxval_t *auxval,
+int elf_load(const char *path, struct pagemap_t *pagemap, size_t base, struct auxval_t *auxval,
         char **out_ld_path) {
     char *ld_path = NULL;
 
-    int ret = lseek(fd, 0, SEEK_SET);
-    if (ret == -1) return -1;
+    struct filemap_t *file = filemap_open(path);
+    if (!file) return -1;
 
     char *magic = "\177ELF";
 
     struct elf_hdr_t hdr;
 
-    ret = read(fd, &hdr, sizeof(struct elf_hdr_t));
+    int ret = filemap_read(file, &hdr, 0, sizeof(struct elf_hdr_t));
     if (ret == -1) return -1;
 
     for (size_t i = 0; i < 4; i++) {
@@ -30,14 +86,10 @@ int elf_load(int fd, struct pagemap_t *pagemap, size_t base, struct auxval_t *au
     if (hdr.ident[EI_OSABI] != ABI_SYSV) return -1;
     if (hdr.machine != ARCH_X86_64) return -1;
 
-    uint64_t phoff = hdr.phoff;
-    ret = lseek(fd, phoff, SEEK_SET);
-    if (ret == -1) return -1;
-
     struct elf_phdr_t *phdr = kalloc(hdr.ph_num * sizeof(struct elf_phdr_t));
     if (!phdr) return -1;
 
-    ret = read(fd, phdr, hdr.ph_num * sizeof(struct elf_phdr_t));
+    ret = filemap_read(file, phdr, hdr.phoff, hdr.ph_num * sizeof(struct elf_phdr_t));
     if (ret == -1) {
         kfree(phdr);
         return -1;
@@ -58,14 +110,7 @@ int elf_load(int fd, struct pagemap_t *pagemap, size_t base, struct auxval_t *au
                 return -1;
             }
 
-            ret = lseek(fd, phdr[i].p_offset, SEEK_SET);
-            if (ret == -1) {
-                kfree(phdr);
-                kfree(ld_path);
-                return -1;
-            }
-
-            ret = read(fd, ld_path, phdr[i].p_filesz);
+            ret = filemap_read(file, ld_path, phdr[i].p_offset, phdr[i].p_filesz);
             if (ret == -1) {
                 kfree(phdr);
                 kfree(ld_path);
@@ -74,37 +119,15 @@ int elf_load(int fd, struct pagemap_t *pagemap, size_t base, struct auxval_t *au
             ld_path[phdr[i].p_filesz] = 0;
         } else if (phdr[i].p_type == PT_PHDR) {
             auxval->at_phdr = base + phdr[i].p_vaddr;
-        } else if (phdr[i].p_type != PT_LOAD)
-            continue;
-
-        size_t page_count = (phdr[i].p_memsz + (PAGE_SIZE - 1)) / PAGE_SIZE;
-
-        /* Allocate space */
-        void *addr = pmm_alloc(page_count);
-        if (!addr) {
-            kfree(phdr);
-            kfree(ld_path);
-            return -1;
-        }
-
-        for (size_t j = 0; j < page_count; j++) {
-            size_t virt = base + phdr[i].p_vaddr + (j * PAGE_SIZE);
-            size_t phys = (size_t)addr + (j * PAGE_SIZE);
-            map_page(pagemap, phys, virt, 0x07);
         }
 
-        char *buf = (char *)((size_t)addr + MEM_PHYS_OFFSET);
-        kmemset(buf, 0, page_count * PAGE_SIZE);
-
-        ret = lseek(fd, phdr[i].p_offset, SEEK_SET);
-        if (ret == -1) {
-            kfree(phdr);
-            kfree(ld_path);
-            return -1;
-        }
+        /* The other segments lie within the PT_LOAD ones */
+        if (phdr[i].p_type != PT_LOAD)
+            continue;
 
-        ret = read(fd, buf + (phdr[i].p_vaddr & (PAGE_SIZE - 1)), phdr[i].p_filesz);
+        ret = map_segment(pagemap, base, file, &phdr[i]);
         if (ret == -1) {
+            kprint(KPRN_WARN, "elf: %s: Unable to map segment %U", path, i);
             kfree(phdr);
             kfree(ld_path);
             return -1;
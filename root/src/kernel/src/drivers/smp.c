@@ -8,7 +8,9 @@
 #include <smp.h>
 #include <time.h>
 #include <mm.h>
+#include <tlb.h>
 #include <task.h>
+#include <sched.h>
 
 #define CPU_STACK_SIZE 16384
 
@@ -19,6 +21,9 @@ int smp_check_ap_flag(void);
 
 int smp_cpu_count = 1;
 
+/* Set once GS points to the CPU local on the BSP, and current_cpu is usable */
+int cpu_locals_ready = 0;
+
 struct tss_t {
     uint32_t unused0 __attribute__((aligned(16)));
     uint64_t rsp0;
@@ -49,12 +54,18 @@ static struct stack_t cpu_stacks[MAX_CPUS] __attribute__((aligned(PAGE_SIZE)));
 static void ap_kernel_entry(void) {
     /* APs jump here after initialisation */
 
+    init_tlb_cpu();
+
     kprint(KPRN_INFO, "smp: Started up AP #%u", current_cpu);
     kprint(KPRN_INFO, "smp: Kernel stack top: %X", cpu_locals[current_cpu].kernel_stack);
 
     /* Enable this AP's local APIC */
     lapic_enable();
 
+    /* Start ticking until the scheduler takes over the timer */
+    asm volatile ("cli");
+    timer_set(uptime_raw + SCHED_TIMESLICE_MS);
+
     /* Enable interrupts */
     asm volatile ("sti");
 
@@ -73,6 +84,12 @@ static inline void setup_cpu_local(int cpu_number, uint8_t lapic_id) {
     cpu_locals[cpu_number].current_thread = -1;
     cpu_locals[cpu_number].current_task = -1;
     cpu_locals[cpu_number].lapic_id = lapic_id;
+    cpu_locals[cpu_number].active_pagemap = &kernel_pagemap;
+    cpu_locals[cpu_number].pcids[0].pagemap = &kernel_pagemap;
+    cpu_locals[cpu_number].pcids[0].gen = kernel_pagemap.tlb_gen;
+    cpu_locals[cpu_number].pcid_next = 1;
+    spinlock_release(&cpu_locals[cpu_number].tlb_queue.lock);
+    sched_init_cpu(cpu_number);
 
     /* Prepare TSS */
     cpu_tss[cpu_number].rsp0 = (uint64_t)&cpu_stacks[cpu_number].stack[CPU_STACK_SIZE];
@@ -129,6 +146,11 @@ static void init_cpu0(void) {
 
     smp_init_cpu0_local(cpu_local, tss);
 
+    /* Not any earlier: real mode calls need paging off, which PCIDs forbid */
+    init_tlb_cpu();
+
+    cpu_locals_ready = 1;
+
     return;
 }
 
@@ -136,6 +158,12 @@ void init_smp(void) {
     /* prepare CPU 0 first */
     init_cpu0();
 
+    /* Every CPU preempts its threads with its own local APIC timer */
+    lapic_timer_calibrate();
+    asm volatile ("cli");
+    timer_set(uptime_raw + SCHED_TIMESLICE_MS);
+    asm volatile ("sti");
+
     /* start up the APs and jump them into the kernel */
     for (size_t i = 1; i < madt_local_apic_i; i++) {
         kprint(KPRN_INFO, "smp: Starting up AP #%u", i);
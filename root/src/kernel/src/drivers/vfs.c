@@ -132,6 +132,7 @@ retry:
             handle.fs = fs;
             handle.intern_fd = intern_fd;
             handle.used = 1;
+            handle.refcount = 1;
 
             /* Register kernel descriptor */
             file_descriptors[i] = handle;
@@ -166,6 +167,9 @@ int write(int fd, const void *buf, size_t len) {
 int close(int fd) {
     if (fd < 0) return -1;
 
+    /* Still in use by another process */
+    if (--file_descriptors[fd].refcount) return 0;
+
     int fs = file_descriptors[fd].fs;
     int intern_fd = file_descriptors[fd].intern_fd;
 
@@ -176,6 +180,16 @@ int close(int fd) {
     return res;
 }
 
+/* Share a descriptor with one more process, as fork() does. It is closed
+ * once every process sharing it closed it. */
+int vfs_dup(int fd) {
+    if (fd < 0) return -1;
+
+    file_descriptors[fd].refcount++;
+
+    return fd;
+}
+
 int lseek(int fd, off_t offset, int type) {
     int fs = file_descriptors[fd].fs;
     int intern_fd = file_descriptors[fd].intern_fd;
@@ -2,6 +2,7 @@
 #include <stddef.h>
 #include <klib.h>
 #include <fs.h>
+#include <slab.h>
 
 #define SEARCH_FAILURE          0xffffffffffffffff
 #define ROOT_ID                 0xffffffffffffffff
@@ -62,13 +63,18 @@ struct mount_t {
     uint64_t dirsize;
     uint64_t dirstart;
     uint64_t datastart;
-    struct cached_file_t *cached_files;
+    struct cached_file_t **cached_files;
     int cached_files_ptr;
 };
 
 static struct mount_t *mounts;
 static int mounts_i = 0;
 
+/* Paths resolved by echfs_open(), along with the file's block chain. Each
+ * one is an object of its own, so that the handles pointing to it stay
+ * valid as the list of a mount grows. */
+static struct slab_cache_t *path_result_cache;
+
 struct echfs_handle_t {
     int free;
     int mnt;
@@ -382,36 +388,38 @@ static int echfs_open(const char *path, int flags, int mode, int mnt) {
 
     if (!mounts[mnt].cached_files_ptr) goto skip_search;
 
-    for (cached_file = 0; kstrcmp(mounts[mnt].cached_files[cached_file].path, path); cached_file++)
+    for (cached_file = 0; kstrcmp(mounts[mnt].cached_files[cached_file]->path, path); cached_file++)
         if (cached_file == (mounts[mnt].cached_files_ptr - 1)) goto skip_search;
 
     goto search_out;
 
 skip_search:
 
-    mounts[mnt].cached_files = krealloc(mounts[mnt].cached_files, sizeof(struct cached_file_t) * (mounts[mnt].cached_files_ptr + 1));
+    mounts[mnt].cached_files = krealloc(mounts[mnt].cached_files, sizeof(struct cached_file_t *) * (mounts[mnt].cached_files_ptr + 1));
     cached_file = mounts[mnt].cached_files_ptr;
+    if (!(mounts[mnt].cached_files[cached_file] = slab_alloc(path_result_cache)))
+        return -1;
 
-    kstrcpy(mounts[mnt].cached_files[cached_file].path, path);
-    mounts[mnt].cached_files[cached_file].path_res = path_result;
+    kstrcpy(mounts[mnt].cached_files[cached_file]->path, path);
+    mounts[mnt].cached_files[cached_file]->path_res = path_result;
 
-    mounts[mnt].cached_files[cached_file].cache = kalloc(mounts[mnt].bytesperblock);
+    mounts[mnt].cached_files[cached_file]->cache = kalloc(mounts[mnt].bytesperblock);
 
-    mounts[mnt].cached_files[cached_file].alloc_map = kalloc(sizeof(uint64_t));
-    mounts[mnt].cached_files[cached_file].alloc_map[0] = mounts[mnt].cached_files[cached_file].path_res.target.payload;
-    for (uint64_t i = 1; mounts[mnt].cached_files[cached_file].alloc_map[i-1] != END_OF_CHAIN; i++) {
-        mounts[mnt].cached_files[cached_file].alloc_map = krealloc(mounts[mnt].cached_files[cached_file].alloc_map, sizeof(uint64_t) * (i + 1));
-        mounts[mnt].cached_files[cached_file].alloc_map[i] = rd_qword(mounts[mnt].device,
-                (mounts[mnt].fatstart * mounts[mnt].bytesperblock) + (mounts[mnt].cached_files[cached_file].alloc_map[i-1] * sizeof(uint64_t)));
+    mounts[mnt].cached_files[cached_file]->alloc_map = kalloc(sizeof(uint64_t));
+    mounts[mnt].cached_files[cached_file]->alloc_map[0] = mounts[mnt].cached_files[cached_file]->path_res.target.payload;
+    for (uint64_t i = 1; mounts[mnt].cached_files[cached_file]->alloc_map[i-1] != END_OF_CHAIN; i++) {
+        mounts[mnt].cached_files[cached_file]->alloc_map = krealloc(mounts[mnt].cached_files[cached_file]->alloc_map, sizeof(uint64_t) * (i + 1));
+        mounts[mnt].cached_files[cached_file]->alloc_map[i] = rd_qword(mounts[mnt].device,
+                (mounts[mnt].fatstart * mounts[mnt].bytesperblock) + (mounts[mnt].cached_files[cached_file]->alloc_map[i-1] * sizeof(uint64_t)));
     }
 
-    mounts[mnt].cached_files[cached_file].cache_status = CACHE_NOTREADY;
+    mounts[mnt].cached_files[cached_file]->cache_status = CACHE_NOTREADY;
 
     mounts[mnt].cached_files_ptr++;
 
 search_out:
 
-    new_handle.cached_file = &mounts[mnt].cached_files[cached_file];
+    new_handle.cached_file = mounts[mnt].cached_files[cached_file];
 
     return echfs_create_handle(new_handle);
 }
@@ -499,6 +507,8 @@ static int echfs_mount(const char *source) {
 void init_echfs(void) {
     struct fs_t echfs = {0};
 
+    path_result_cache = slab_cache_create("echfs_path_result", sizeof(struct cached_file_t));
+
     kstrcpy(echfs.type, "echfs");
     echfs.mount = (void *)echfs_mount;
     echfs.open = echfs_open;
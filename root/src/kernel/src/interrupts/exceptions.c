@@ -1,6 +1,9 @@
 #include <stddef.h>
 #include <exceptions.h>
 #include <panic.h>
+#include <mm.h>
+#include <vma.h>
+#include <smp.h>
 
 void div0_handler(size_t cs, size_t ip) {
     kexcept("Divide by 0!", cs, ip, 0, 0);
@@ -62,6 +65,12 @@ void page_fault_handler(size_t cs, size_t ip, size_t error_code) {
         : "=r" (faulting_addr)
     );
 
+    /* Faults on the areas of a process are resolved by backing the page */
+    if (faulting_addr < MEM_PHYS_OFFSET && cpu_locals_ready) {
+        if (!vma_handle_fault(cpu_locals[current_cpu].active_pagemap, faulting_addr, error_code))
+            return;
+    }
+
     kexcept("CPU exception: Page fault!", cs, ip, error_code, faulting_addr);
 }
 
@@ -4,6 +4,7 @@
 #include <exceptions.h>
 #include <irq.h>
 #include <ipi.h>
+#include <apic.h>
 #include <syscall.h>
 
 static struct idt_entry_t idt[256];
@@ -42,7 +43,8 @@ void init_idt(void) {
     /* Inter-processor interrupts */
     register_interrupt_handler(IPI_ABORT, ipi_abort, 1, 0x8e);
     register_interrupt_handler(IPI_RESCHED, ipi_resched, 1, 0x8e);
-    register_interrupt_handler(IPI_ABORTEXEC, ipi_abortexec, 1, 0x8e);
+    /* This one returns to the interrupted code, so it cannot use the IST */
+    register_interrupt_handler(IPI_TLB, ipi_tlb, 0, 0x8e);
 
     for (size_t i = 0; i < 16; i++) {
         register_interrupt_handler(0x90 + i, apic_nmi, 1, 0x8e);
@@ -60,6 +62,9 @@ void init_idt(void) {
 
     register_interrupt_handler(0xff, apic_spurious, 1, 0x8e);
 
+    /* Like IPI_RESCHED, the timer switches away from the interrupted code */
+    register_interrupt_handler(APIC_TIMER_VECTOR, apic_timer, 1, 0x8e);
+
     struct idt_ptr_t idt_ptr = {
         sizeof(idt) - 1,
         (uint64_t)idt
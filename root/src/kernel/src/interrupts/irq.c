@@ -13,9 +13,7 @@
 
 /* Interrupts should be OFF */
 void pit_handler(void) {
-    if (!(++uptime_raw % PIT_FREQUENCY)) {
-        uptime_sec++;
-    }
+    pit_uptime++;
 
     return;
 }
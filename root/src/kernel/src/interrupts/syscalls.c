@@ -7,6 +7,8 @@
 #include <fs.h>
 #include <task.h>
 #include <mm.h>
+#include <vma.h>
+#include <shm.h>
 
 /* Prototype syscall: int syscall_name(struct ctx_t *ctx) */
 
@@ -34,24 +36,257 @@ void *syscall_alloc_at(struct ctx_t *ctx) {
     struct process_t *process = process_table[current_process];
 
     size_t base_address;
-    if (ctx->rdi) {
+    if (ctx->rdi)
         base_address = ctx->rdi;
-    } else {
+    else
         base_address = process->cur_brk;
+
+    /* Whatever was mapped in the range is replaced, like with MAP_FIXED.
+     * The pages are backed when first touched. */
+    if (vma_unmap(process->pagemap, base_address, ctx->rsi * PAGE_SIZE))
+        return (void *)0;
+    if (vma_map(process->pagemap, base_address, ctx->rsi * PAGE_SIZE,
+                PROT_READ | PROT_WRITE | PROT_EXEC))
+        return (void *)0;
+
+    if (!ctx->rdi)
         process->cur_brk += ctx->rsi * PAGE_SIZE;
-    }
 
-    for (size_t i = 0; i < ctx->rsi; i++) {
-        void *ptr = pmm_alloc(1);
-        if (!ptr)
-            return (void *)0;
-        if (map_page(process->pagemap, (size_t)ptr, base_address + i * PAGE_SIZE, 0x07))
-            return (void *)0;
+    return (void *)base_address;
+}
+
+#define MAP_FAILED ((void *)-1)
+
+#define MAP_SHARED 0x01
+#define MAP_PRIVATE 0x02
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+
+void *syscall_mmap(struct ctx_t *ctx) {
+    // rdi: address hint
+    // rsi: length
+    // rdx: protection
+    // r10: flags
+    // r8: fd
+    // r9: offset
+
+    pid_t current_process = cpu_locals[current_cpu].current_process;
+
+    struct process_t *process = process_table[current_process];
+
+    /* Only private anonymous mappings for now */
+    if (!(ctx->r10 & MAP_ANONYMOUS) || !(ctx->r10 & MAP_PRIVATE))
+        return MAP_FAILED;
+
+    if (ctx->rdx & ~(PROT_READ | PROT_WRITE | PROT_EXEC))
+        return MAP_FAILED;
+
+    if (ctx->r10 & MAP_FIXED) {
+        /* Whatever was mapped in the range is replaced */
+        if (vma_unmap(process->pagemap, ctx->rdi, ctx->rsi))
+            return MAP_FAILED;
+        if (vma_map(process->pagemap, ctx->rdi, ctx->rsi, ctx->rdx))
+            return MAP_FAILED;
+        return (void *)ctx->rdi;
     }
 
+    size_t base_address = vma_map_anywhere(process->pagemap, ctx->rdi, ctx->rsi, ctx->rdx);
+    if (!base_address)
+        return MAP_FAILED;
+
+    return (void *)base_address;
+}
+
+int syscall_munmap(struct ctx_t *ctx) {
+    // rdi: address
+    // rsi: length
+
+    pid_t current_process = cpu_locals[current_cpu].current_process;
+
+    struct process_t *process = process_table[current_process];
+
+    return vma_unmap(process->pagemap, ctx->rdi, ctx->rsi);
+}
+
+int syscall_mprotect(struct ctx_t *ctx) {
+    // rdi: address
+    // rsi: length
+    // rdx: protection
+
+    if (ctx->rdx & ~(PROT_READ | PROT_WRITE | PROT_EXEC))
+        return -1;
+
+    pid_t current_process = cpu_locals[current_cpu].current_process;
+
+    struct process_t *process = process_table[current_process];
+
+    return vma_protect(process->pagemap, ctx->rdi, ctx->rsi, ctx->rdx);
+}
+
+struct vm_stats_t {
+    size_t pages;
+    size_t large_pages;
+};
+
+int syscall_vm_stats(struct ctx_t *ctx) {
+    // rdi: struct vm_stats_t to fill in
+
+    //TODO:privilege_check_buf((const void *)ctx->rdi, sizeof(struct vm_stats_t));
+
+    pid_t current_process = cpu_locals[current_cpu].current_process;
+
+    struct process_t *process = process_table[current_process];
+
+    struct vm_stats_t *stats = (struct vm_stats_t *)ctx->rdi;
+
+    /* Counted into locals, the pagemap lock is held meanwhile and the
+     * buffer may not be backed yet */
+    size_t pages, large_pages;
+    vmm_stats(process->pagemap, &pages, &large_pages);
+
+    stats->pages = pages;
+    stats->large_pages = large_pages;
+
+    return 0;
+}
+
+int syscall_shm_open(struct ctx_t *ctx) {
+    // rdi: name
+    // rsi: size, used when the segment is created
+    // rdx: flags
+    // returns a handle local to the process
+
+    //TODO:privilege_check_string((const char *)ctx->rdi);
+
+    pid_t current_process = cpu_locals[current_cpu].current_process;
+
+    struct process_t *process = process_table[current_process];
+
+    int handle;
+
+    for (handle = 0; process->shm_handles[handle] != -1; handle++)
+        if (handle + 1 == MAX_SHM_HANDLES)
+            return -1;
+
+    /* Copied before any lock is taken, the name may not be backed yet */
+    char name[SHM_NAME_MAX];
+    const char *user_name = (const char *)ctx->rdi;
+    size_t i;
+    for (i = 0; i < SHM_NAME_MAX && user_name[i]; i++)
+        name[i] = user_name[i];
+    if (i == SHM_NAME_MAX)
+        return -1;
+    name[i] = 0;
+
+    int id = shm_open(name, ctx->rsi, ctx->rdx);
+    if (id == -1)
+        return -1;
+
+    process->shm_handles[handle] = id;
+
+    return handle;
+}
+
+void *syscall_shm_map(struct ctx_t *ctx) {
+    // rdi: handle
+    // rsi: address hint
+    // rdx: protection
+
+    pid_t current_process = cpu_locals[current_cpu].current_process;
+
+    struct process_t *process = process_table[current_process];
+
+    if (ctx->rdi >= MAX_SHM_HANDLES || process->shm_handles[ctx->rdi] == -1)
+        return MAP_FAILED;
+
+    size_t base_address = shm_map(process->pagemap, process->shm_handles[ctx->rdi],
+                                  ctx->rsi, ctx->rdx);
+    if (!base_address)
+        return MAP_FAILED;
+
     return (void *)base_address;
 }
 
+int syscall_shm_close(struct ctx_t *ctx) {
+    // rdi: handle
+
+    pid_t current_process = cpu_locals[current_cpu].current_process;
+
+    struct process_t *process = process_table[current_process];
+
+    if (ctx->rdi >= MAX_SHM_HANDLES || process->shm_handles[ctx->rdi] == -1)
+        return -1;
+
+    if (shm_close(process->shm_handles[ctx->rdi]) == -1)
+        return -1;
+
+    process->shm_handles[ctx->rdi] = -1;
+
+    return 0;
+}
+
+int syscall_fork(struct ctx_t *ctx) {
+    // returns the child's PID to the parent, 0 to the child
+
+    return task_pfork(ctx);
+}
+
+int syscall_exit(struct ctx_t *ctx) {
+    // rdi: exit status, not reported anywhere yet
+
+    (void)ctx;
+
+    task_pexit();
+
+    /* Not reached */
+    return -1;
+}
+
+int syscall_setpriority(struct ctx_t *ctx) {
+    // rdi: PID, 0 for the calling process
+    // rsi: priority, from -20 to 19, lower runs more
+
+    pid_t pid = ctx->rdi ? (pid_t)ctx->rdi : CURRENT_PROCESS;
+
+    return task_setpriority(pid, (int)ctx->rsi);
+}
+
+int syscall_sched_setaffinity(struct ctx_t *ctx) {
+    // rdi: PID, 0 for the calling process
+    // rsi: TID, -1 for the whole process
+    // rdx: size of the mask in bytes
+    // r10: mask, bit N set if the thread may run on CPU #N
+
+    pid_t pid = ctx->rdi ? (pid_t)ctx->rdi : CURRENT_PROCESS;
+
+    struct cpumask_t mask = {0};
+    size_t size = ctx->rdx < sizeof(mask) ? ctx->rdx : sizeof(mask);
+    kmemcpy(&mask, (void *)ctx->r10, size);
+
+    return task_setaffinity(pid, (tid_t)ctx->rsi, &mask);
+}
+
+int syscall_sched_getaffinity(struct ctx_t *ctx) {
+    // rdi: PID, 0 for the calling process
+    // rsi: TID, -1 for the whole process
+    // rdx: size of the mask in bytes, at least sizeof(struct cpumask_t)
+    // r10: mask
+
+    pid_t pid = ctx->rdi ? (pid_t)ctx->rdi : CURRENT_PROCESS;
+
+    if (ctx->rdx < sizeof(struct cpumask_t))
+        return -1;
+
+    struct cpumask_t mask;
+    if (task_getaffinity(pid, (tid_t)ctx->rsi, &mask))
+        return -1;
+
+    /* Nothing past the mask is written */
+    kmemcpy((void *)ctx->r10, &mask, sizeof(mask));
+
+    return 0;
+}
+
 #define AT_ENTRY 10
 #define AT_PHDR 20
 #define AT_PHENT 21
@@ -0,0 +1,22 @@
+#include <stddef.h>
+#include <klib.h>
+#include <cmdline.h>
+#include <bench.h>
+
+/* Boot-time benchmarks are requested on the command line as
+ * bench=<name>[,<name>...], this returns 1 if `name` is one of them. */
+int bench_enabled(const char *name) {
+    char *list = cmdline_get_value("bench");
+    size_t len = kstrlen(name);
+
+    if (!list)
+        return 0;
+
+    for (;;) {
+        if (!kstrncmp(list, name, len) && (list[len] == ',' || !list[len]))
+            return 1;
+        list = kstrchrnul(list, ',');
+        if (!*list)
+            return 0;
+    }
+}
@@ -7,6 +7,7 @@
 #include <tty.h>
 #include <mm.h>
 #include <time.h>
+#include <slab.h>
 
 int ktolower(int c) {
     if (c >= 0x41 && c <= 0x5a)
@@ -201,37 +202,25 @@ out:
     return;
 }
 
-typedef struct {
-    size_t pages;
-    size_t size;
-} alloc_metadata_t;
-
 void *kalloc(size_t size) {
-    size_t page_count = size / PAGE_SIZE;
-
-    if (size % PAGE_SIZE) page_count++;
-
-    char *ptr = pmm_alloc(page_count + 1);
-
-    if (!ptr) {
-        return (void *)0;
-    }
-
-    ptr += MEM_PHYS_OFFSET;
-
-    alloc_metadata_t *metadata = (alloc_metadata_t *)ptr;
-    ptr += PAGE_SIZE;
+    /* Small allocations are served by the slab size classes, anything
+     * larger is virtually contiguous */
+    if (size <= SLAB_MAX_SIZE)
+        return slab_kalloc(size);
 
-    metadata->pages = page_count;
-    metadata->size = size;
-
-    return (void *)ptr;
+    return vmalloc(size);
 }
 
 void kfree(void *ptr) {
-    alloc_metadata_t *metadata = (alloc_metadata_t *)((size_t)ptr - PAGE_SIZE);
+    if (!ptr)
+        return;
 
-    pmm_free((void *)((size_t)metadata - MEM_PHYS_OFFSET), metadata->pages + 1);
+    if (is_slab_object(ptr)) {
+        slab_free(ptr);
+        return;
+    }
+
+    vfree(ptr);
 }
 
 void *krealloc(void *ptr, size_t new) {
@@ -242,20 +231,27 @@ void *krealloc(void *ptr, size_t new) {
         return (void *)0;
     }
 
-    /* Reference metadata page */
-    alloc_metadata_t *metadata = (alloc_metadata_t *)((size_t)ptr - PAGE_SIZE);
+    size_t old_size;
+    if (is_slab_object(ptr)) {
+        old_size = slab_object_size(ptr);
+    } else {
+        /* Stay in the vmalloc area: it grows without copying */
+        if (new > SLAB_MAX_SIZE)
+            return vrealloc(ptr, new);
+        old_size = vmalloc_size(ptr);
+    }
 
     char *new_ptr;
     if ((new_ptr = kalloc(new)) == 0) {
         return (void *)0;
     }
 
-    if (metadata->size > new)
+    if (old_size > new)
         /* Copy all the data from the old pointer to the new pointer,
          * within the range specified by `size`. */
         kmemcpy(new_ptr, (char *)ptr, new);
     else
-        kmemcpy(new_ptr, (char *)ptr, metadata->size);
+        kmemcpy(new_ptr, (char *)ptr, old_size);
 
     kfree(ptr);
 
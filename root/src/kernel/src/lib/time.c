@@ -1,10 +1,82 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <cpuid.h>
 #include <time.h>
 #include <pit.h>
+#include <pic.h>
+#include <apic.h>
+#include <smp.h>
+#include <bench.h>
+#include <klib.h>
+#include <task.h>
 
-volatile uint64_t uptime_raw = 0;
-volatile uint64_t uptime_sec = 0;
+/* Milliseconds counted by the PIT. Until time_use_tsc() is called, this is
+ * the uptime. */
+volatile uint64_t pit_uptime = 0;
+
+/* TSC ticks per millisecond, and the TSC and uptime when it took over from
+ * the PIT */
+static uint64_t tsc_freq = 0;
+static uint64_t tsc_base;
+static uint64_t tsc_base_ms;
+
+uint64_t uptime_us(void) {
+    if (!tsc_freq)
+        return pit_uptime * 1000;
+
+    uint64_t ticks = rdtsc() - tsc_base;
+    return (tsc_base_ms + ticks / tsc_freq) * 1000 + (ticks % tsc_freq) * 1000 / tsc_freq;
+}
+
+/* Keep time with the TSC, measured to run at `freq` ticks per millisecond,
+ * and stop the PIT interrupting CPU 0 every millisecond. The PIT is kept if
+ * the TSC rate can vary. */
+void time_use_tsc(uint64_t freq) {
+    unsigned int eax, ebx, ecx, edx = 0;
+
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) {
+        kprint(KPRN_INFO, "time: TSC is not invariant, keeping time with the PIT");
+        return;
+    }
+
+    uint64_t rflags = interrupts_save();
+    tsc_base = rdtsc();
+    tsc_base_ms = pit_uptime;
+    tsc_freq = freq;
+    interrupts_restore(rflags);
+
+    pic_set_mask(0, 0);
+
+    kprint(KPRN_INFO, "time: Keeping time with the TSC, %U ticks per ms", freq);
+}
+
+/* Program this CPU's timer to fire at `deadline`, in milliseconds of
+ * uptime, or stop it if 0. Interrupts should be OFF */
+void timer_set(uint64_t deadline) {
+    cpu_locals[current_cpu].timer_deadline = deadline;
+
+    if (!deadline) {
+        lapic_timer_oneshot(0);
+        return;
+    }
+
+    uint64_t target = deadline * 1000;
+    /* The PIT only tells the time to the millisecond, firing early would
+     * find the deadline not reached yet */
+    if (!tsc_freq)
+        target += 1000;
+
+    uint64_t now = uptime_us();
+    lapic_timer_oneshot(target > now ? target - now : 1);
+}
+
+/* Make sure this CPU's timer fires by `deadline`. Interrupts should be OFF */
+void timer_arm(uint64_t deadline) {
+    uint64_t armed = cpu_locals[current_cpu].timer_deadline;
+
+    if (!armed || deadline < armed)
+        timer_set(deadline);
+}
 
 void ksleep(uint64_t time) {
     /* implements sleep in milliseconds */
@@ -14,7 +86,16 @@ void ksleep(uint64_t time) {
     final_time++;
 
     while (uptime_raw < final_time) {
-        asm volatile ("hlt");
+        /* Threads sleep in the timer wheel of their CPU */
+        if (!task_sleep_until(final_time))
+            continue;
+
+        /* Otherwise halt. Nothing else may wake the CPU up, and the timer
+         * must not fire between arming it and halting. sti only takes
+         * effect after the next instruction. */
+        asm volatile ("cli");
+        timer_arm(final_time);
+        asm volatile ("sti; hlt");
     }
 
     return;
@@ -5,6 +5,7 @@
 #include <task.h>
 #include <klib.h>
 #include <elf.h>
+#include <vma.h>
 
 /* TODO expand this to be like execve */
 pid_t kexec(const char *filename, const char *argv[], const char *envp[]) {
@@ -12,31 +13,16 @@ pid_t kexec(const char *filename, const char *argv[], const char *envp[]) {
     size_t entry;
 
     /* Create a new pagemap for the process */
-    pt_entry_t *pml4 = (pt_entry_t *)((size_t)pmm_alloc(1) + MEM_PHYS_OFFSET);
-    if ((size_t)pml4 == MEM_PHYS_OFFSET) return -1;
-
-    struct pagemap_t *pagemap = kalloc(sizeof(struct pagemap_t));
-    if (!pagemap) {
-        pmm_free((void *)((size_t)pml4 - MEM_PHYS_OFFSET), 1);
-        return -1;
-    }
-    pagemap->pml4 = pml4;
-    spinlock_release(&pagemap->lock);
+    struct pagemap_t *pagemap = new_pagemap();
+    if (!pagemap) return -1;
 
     /* Load the executable */
-    int fd = open(filename, 0, 0);
-    if (fd == -1) {
-        kfree(pagemap);
-        pmm_free((void *)((size_t)pml4 - MEM_PHYS_OFFSET), 1);
-        return -1;
-    }
-
     struct auxval_t auxval;
     char *ld_path;
-    ret = elf_load(fd, pagemap, 0, &auxval, &ld_path);
-    close(fd);
+    ret = elf_load(filename, pagemap, 0, &auxval, &ld_path);
     if (ret == -1) {
         kprint(KPRN_DBG, "elf: Load of binary file %s failed.", filename);
+        vma_destroy(pagemap);
         return -1;
     }
     kprint(KPRN_DBG, "elf: %s successfully loaded.", filename);
@@ -49,20 +35,14 @@ pid_t kexec(const char *filename, const char *argv[], const char *envp[]) {
     if (!ld_path) {
         entry = auxval.at_entry;
     } else {
-        int ld_fd = open(ld_path, 0, 0);
-        kfree(ld_path);
-        if (ret == -1) {
-            kprint(KPRN_DBG, "elf: Could not find dynamic linker.");
-            return -1;
-        }
-
         /* 1 GiB is chosen arbitrarily (as programs are expected to fit below 1 GiB).
            TODO: Dynamically find a virtual address range that is large enough */
         struct auxval_t ld_auxval;
-        ret = elf_load(ld_fd, pagemap, 0x40000000, &ld_auxval, NULL);
-        close(ld_fd);
+        ret = elf_load(ld_path, pagemap, 0x40000000, &ld_auxval, NULL);
+        kfree(ld_path);
         if (ret == -1) {
-            kprint(KPRN_DBG, "elf: Load of binary file %s failed.", filename);
+            kprint(KPRN_DBG, "elf: Could not load dynamic linker.");
+            vma_destroy(pagemap);
             return -1;
         }
         kprint(KPRN_DBG, "elf: Loading dynamic linker succeeded.");
@@ -76,7 +56,10 @@ pid_t kexec(const char *filename, const char *argv[], const char *envp[]) {
 
     /* Create a new process */
     pid_t new_pid = task_pcreate(pagemap);
-    if (new_pid == (pid_t)(-1)) return -1;
+    if (new_pid == (pid_t)(-1)) {
+        vma_destroy(pagemap);
+        return -1;
+    }
 
     process_table[new_pid]->auxval = auxval;
 
@@ -24,8 +24,17 @@
 #include <ahci.h>
 #include <time.h>
 #include <kbd.h>
+#include <bench.h>
+#include <slab.h>
+#include <tlb.h>
+#include <vma.h>
+#include <sched.h>
 
 void kmain_thread(void) {
+    /* Needs the scheduler running, unlike the boot-time ones */
+    if (bench_enabled("sched"))
+        sched_bench();
+
     /* Execute a test process */
     spinlock_acquire(&scheduler_lock);
     kexec("/bin/test", 0, 0);/*
@@ -38,6 +47,18 @@ void kmain_thread(void) {
 
     kprint(KPRN_INFO, "kmain: End of init.");
 
+    char *slabinfo = cmdline_get_value("slabinfo");
+    if (slabinfo && !kstrcmp(slabinfo, "enabled"))
+        slab_report();
+
+    char *tlbinfo = cmdline_get_value("tlbinfo");
+    if (tlbinfo && !kstrcmp(tlbinfo, "enabled"))
+        tlb_report();
+
+    char *schedinfo = cmdline_get_value("schedinfo");
+    if (schedinfo && !kstrcmp(schedinfo, "enabled"))
+        sched_report();
+
     for (;;) asm volatile ("hlt;");
 }
 
@@ -65,6 +86,10 @@ void kmain(void) {
     init_e820();
     init_pmm();
     init_vmm();
+    init_pmm_buddy();
+    init_slab();
+    init_vmalloc();
+    init_vma();
 
     /* Early inits */
     init_vbe();
@@ -78,6 +103,14 @@ void kmain(void) {
     init_pit();
     init_smp();
 
+    /* Boot-time benchmarks, requested with bench=<name>[,<name>...] */
+    if (bench_enabled("pmm"))
+        pmm_bench();
+    if (bench_enabled("vmfork"))
+        vma_fork_bench();
+    if (bench_enabled("teardown"))
+        vma_teardown_bench();
+
     /* Initialise device drivers */
     init_ata();
     init_pci();
@@ -0,0 +1,154 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <filemap.h>
+#include <mm.h>
+#include <tlb.h>
+#include <fs.h>
+#include <klib.h>
+#include <lock.h>
+
+static struct filemap_t *filemaps = (void *)0;
+static lock_t filemaps_lock = 1;
+
+/* Returns the cache of the file at `path`, creating it if this is the first
+ * time the file is mapped. The file is kept open for reading pages in
+ * later. Returns NULL on failure. */
+struct filemap_t *filemap_open(const char *path) {
+    struct filemap_t *file;
+
+    if (kstrlen(path) >= FILEMAP_PATH_MAX)
+        return (void *)0;
+
+    spinlock_acquire(&filemaps_lock);
+
+    for (file = filemaps; file; file = file->next) {
+        if (!kstrcmp(file->path, path))
+            goto out;
+    }
+
+    struct stat st;
+    int fd = open(path, O_RDONLY, 0);
+    if (fd == -1)
+        goto out;
+    if (fstat(fd, &st) == -1 || !st.st_size)
+        goto fail;
+
+    file = kalloc(sizeof(struct filemap_t));
+    if (!file)
+        goto fail;
+
+    file->page_count = (st.st_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    file->pages = kalloc(file->page_count * sizeof(size_t));
+    if (!file->pages) {
+        kfree(file);
+        file = (void *)0;
+        goto fail;
+    }
+
+    kstrcpy(file->path, path);
+    file->fd = fd;
+    file->size = st.st_size;
+    spinlock_release(&file->lock);
+    spinlock_release(&file->io_lock);
+    file->next = filemaps;
+    filemaps = file;
+
+out:
+    spinlock_release(&filemaps_lock);
+    return file;
+
+fail:
+    close(fd);
+    spinlock_release(&filemaps_lock);
+    return (void *)0;
+}
+
+/* Returns the physical address of page `index` of the file if it was read
+ * already, without reading it otherwise. For the page fault handler, which
+ * runs with interrupts disabled and cannot do I/O. Returns NULL if the page
+ * is not in the cache. */
+void *filemap_lookup(struct filemap_t *file, size_t index) {
+    if (index >= file->page_count)
+        return (void *)0;
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&file->lock);
+
+    void *page = (void *)file->pages[index];
+
+    spinlock_release(&file->lock);
+    interrupts_restore(rflags);
+    return page;
+}
+
+/* Returns the physical address of page `index` of the file, reading it in
+ * if nobody did yet. The part of the last page past the end of the file is
+ * zeroed. Does I/O, so must not be called with interrupts disabled or with
+ * locks held which the page fault handler takes. Returns NULL on failure. */
+void *filemap_page(struct filemap_t *file, size_t index) {
+    void *page = filemap_lookup(file, index);
+    if (page || index >= file->page_count)
+        return page;
+
+    if (!(page = pmm_alloc(1)))
+        return (void *)0;
+
+    size_t len = file->size - index * PAGE_SIZE;
+    if (len > PAGE_SIZE)
+        len = PAGE_SIZE;
+
+    spinlock_acquire(&file->io_lock);
+    int ret = -1;
+    if (lseek(file->fd, index * PAGE_SIZE, SEEK_SET) != -1
+     && read(file->fd, (void *)((size_t)page + MEM_PHYS_OFFSET), len) != -1)
+        ret = 0;
+    spinlock_release(&file->io_lock);
+
+    if (ret) {
+        pmm_free(page, 1);
+        return (void *)0;
+    }
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&file->lock);
+
+    /* Somebody may have read the page in meanwhile, theirs is kept */
+    if (file->pages[index]) {
+        pmm_free(page, 1);
+        page = (void *)file->pages[index];
+    } else {
+        /* The cache keeps the reference the page was allocated with */
+        pmm_page((size_t)page)->flags |= PG_FILE;
+        file->pages[index] = (size_t)page;
+    }
+
+    spinlock_release(&file->lock);
+    interrupts_restore(rflags);
+    return page;
+}
+
+/* Copy `len` bytes at `offset` of the file into `buf`, through the cache */
+/* Returns 0 on success, -1 on failure */
+int filemap_read(struct filemap_t *file, void *buf, size_t offset, size_t len) {
+    if (offset + len > file->size || offset + len < offset)
+        return -1;
+
+    while (len) {
+        size_t page_offset = offset & (PAGE_SIZE - 1);
+        size_t count = PAGE_SIZE - page_offset;
+        if (count > len)
+            count = len;
+
+        void *page = filemap_page(file, offset / PAGE_SIZE);
+        if (!page)
+            return -1;
+
+        kmemcpy(buf, (void *)((size_t)page + MEM_PHYS_OFFSET + page_offset), count);
+
+        buf = (void *)((size_t)buf + count);
+        offset += count;
+        len -= count;
+    }
+
+    return 0;
+}
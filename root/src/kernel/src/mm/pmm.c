@@ -4,23 +4,48 @@
 #include <klib.h>
 #include <lock.h>
 #include <e820.h>
+#include <bench.h>
+#include <smp.h>
 
 #define MEMORY_BASE 0x1000000
 #define BITMAP_BASE (MEMORY_BASE / PAGE_SIZE)
 
-#define BMREALLOC_STEP 1
+/* Blocks of order k are 2^k pages long and aligned to 2^k pages */
+#define PMM_MAX_ORDER 20
 
 static volatile uint32_t *mem_bitmap;
-static volatile uint32_t initial_bitmap[] = { 0xfffffffe };
-static volatile uint32_t *tmp_bitmap;
-
-/* 32 entries because initial_bitmap is a single dword */
-static size_t bitmap_entries = 32;
+static size_t bitmap_entries;
 
 /* A core wishing to modify the PMM bitmap must first acquire this lock,
- * to ensure other cores cannot simultaneously modify the bitmap */
+ * to ensure other cores cannot simultaneously modify the bitmap. It is
+ * taken with interrupts disabled, as the page caches and the page fault
+ * handler need it with interrupts off, and would spin forever on a holder
+ * preempted on the same CPU. */
 static lock_t pmm_lock = 1;
 
+/* Free blocks are linked through their own first page, using the
+ * physical memory mapping, so the buddy allocator can only be enabled once
+ * init_vmm() has mapped all the usable memory. Until then, allocations are
+ * served by scanning the bitmap. */
+struct buddy_node_t {
+    struct buddy_node_t *next;
+    struct buddy_node_t *prev;
+};
+
+static int buddy_ready = 0;
+static struct buddy_node_t free_lists[PMM_MAX_ORDER];
+static size_t free_counts[PMM_MAX_ORDER];
+
+/* For each order, one bit per block (indexed by page >> order) which is set
+ * if that block is currently on the free list of that order */
+static volatile uint32_t *order_bitmaps[PMM_MAX_ORDER];
+static size_t order_entries[PMM_MAX_ORDER];
+
+/* The page frame database: a struct page_t for every page the bitmap
+ * covers, indexed by PFN - BITMAP_BASE. It is set up along with the buddy
+ * allocator, before that the pages have no metadata. */
+static struct page_t *page_db = (void *)0;
+
 static inline int read_bitmap(size_t i) {
     i -= BITMAP_BASE;
 
@@ -44,85 +69,172 @@ static inline void write_bitmap(size_t i, int val) {
     return;
 }
 
-/* Populate bitmap using e820 data. */
-void init_pmm(void) {
-    mem_bitmap = initial_bitmap;
-    if (!(tmp_bitmap = pmm_alloc(BMREALLOC_STEP))) {
-        kprint(KPRN_ERR, "pmm_alloc failure in init_pmm(). Halted.");
-        for (;;);
+/* Mark a range of pages, whole dwords at a time where possible */
+static void write_bitmap_range(size_t start, size_t pg_count, int val) {
+    size_t i = start - BITMAP_BASE;
+    size_t end = i + pg_count;
+
+    for (; i < end && i % 32; i++)
+        write_bitmap(i + BITMAP_BASE, val);
+
+    for (; i + 32 <= end; i += 32)
+        mem_bitmap[i / 32] = val ? 0xffffffff : 0;
+
+    for (; i < end; i++)
+        write_bitmap(i + BITMAP_BASE, val);
+
+    return;
+}
+
+static inline int read_order_bitmap(int order, size_t page) {
+    size_t i = page >> order;
+
+    if (i >= order_entries[order])
+        return 0;
+
+    return (int)((order_bitmaps[order][i / 32] >> (i % 32)) & 1);
+}
+
+static inline void write_order_bitmap(int order, size_t page, int val) {
+    size_t i = page >> order;
+
+    if (val)
+        order_bitmaps[order][i / 32] |= (1 << (i % 32));
+    else
+        order_bitmaps[order][i / 32] &= ~(1 << (i % 32));
+
+    return;
+}
+
+static inline struct buddy_node_t *page_to_node(size_t page) {
+    return (struct buddy_node_t *)(page * PAGE_SIZE + MEM_PHYS_OFFSET);
+}
+
+static inline size_t node_to_page(struct buddy_node_t *node) {
+    return ((size_t)node - MEM_PHYS_OFFSET) / PAGE_SIZE;
+}
+
+static void buddy_list_remove(int order, size_t page) {
+    struct buddy_node_t *node = page_to_node(page);
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+
+    write_order_bitmap(order, page, 0);
+    free_counts[order]--;
+
+    return;
+}
+
+/* Freed blocks go to the front of the list, since they are likely
+ * to still be cache hot. */
+static void buddy_list_push(int order, size_t page, int tail) {
+    struct buddy_node_t *head = &free_lists[order];
+    struct buddy_node_t *node = page_to_node(page);
+
+    if (tail) {
+        node->next = head;
+        node->prev = head->prev;
+    } else {
+        node->next = head->next;
+        node->prev = head;
     }
+    node->next->prev = node;
+    node->prev->next = node;
 
-    tmp_bitmap = (uint32_t *)((size_t)tmp_bitmap + MEM_PHYS_OFFSET);
+    write_order_bitmap(order, page, 1);
+    free_counts[order]++;
 
-    for (size_t i = 0; i < (BMREALLOC_STEP * PAGE_SIZE) / sizeof(uint32_t); i++)
-        tmp_bitmap[i] = 0xffffffff;
+    return;
+}
 
-    mem_bitmap = tmp_bitmap;
+/* Return a block to the free lists, merging it with its buddy
+ * for as long as the buddy is free as a whole. */
+static void buddy_free_block(size_t page, int order, int tail) {
+    while (order < PMM_MAX_ORDER - 1) {
+        size_t buddy = page ^ ((size_t)1 << order);
 
-    bitmap_entries = ((PAGE_SIZE / sizeof(uint32_t)) * 32) * BMREALLOC_STEP;
+        if (!read_order_bitmap(order, buddy))
+            break;
 
-    kprint(KPRN_INFO, "pmm: Mapping memory as specified by the e820...");
+        buddy_list_remove(order, buddy);
+        page &= ~((size_t)1 << order);
+        order++;
+    }
 
-    /* For each region specified by the e820, iterate over each page which
-       fits in that region and if the region type indicates the area itself
-       is usable, write that page as free in the bitmap. Otherwise, mark the page as used. */
-    for (size_t i = 0; e820_map[i].type; i++) {
-        size_t aligned_base;
-        if (e820_map[i].base % PAGE_SIZE)
-            aligned_base = e820_map[i].base + (PAGE_SIZE - (e820_map[i].base % PAGE_SIZE));
-        else
-            aligned_base = e820_map[i].base;
-        size_t aligned_length = (e820_map[i].length / PAGE_SIZE) * PAGE_SIZE;
-        if ((e820_map[i].base % PAGE_SIZE) && aligned_length) aligned_length -= PAGE_SIZE;
+    buddy_list_push(order, page, tail);
 
-        for (size_t j = 0; j * PAGE_SIZE < aligned_length; j++) {
-            size_t addr = aligned_base + j * PAGE_SIZE;
+    return;
+}
 
-            size_t page = addr / PAGE_SIZE;
+/* Split an arbitrary range of pages into naturally aligned blocks and
+ * give them to the buddy allocator. The bitmap is not touched. */
+static void buddy_insert_range(size_t page, size_t pg_count, int tail) {
+    while (pg_count) {
+        int order = 0;
 
-            if (addr < (MEMORY_BASE + PAGE_SIZE /* bitmap */))
-                continue;
+        while (order + 1 < PMM_MAX_ORDER
+               && !(page & (((size_t)2 << order) - 1))
+               && ((size_t)2 << order) <= pg_count)
+            order++;
 
-            if (addr >= (MEMORY_BASE + bitmap_entries * PAGE_SIZE)) {
-                /* Reallocate bitmap */
-                size_t cur_bitmap_size_in_pages = ((bitmap_entries / 32) * sizeof(uint32_t)) / PAGE_SIZE;
-                size_t new_bitmap_size_in_pages = cur_bitmap_size_in_pages + BMREALLOC_STEP;
-                if (!(tmp_bitmap = pmm_alloc(new_bitmap_size_in_pages))) {
-                    kprint(KPRN_ERR, "pmm_alloc failure in init_pmm(). Halted.");
-                    for (;;);
-                }
-                tmp_bitmap = (uint32_t *)((size_t)tmp_bitmap + MEM_PHYS_OFFSET);
-                /* Copy over previous bitmap */
-                for (size_t i = 0;
-                     i < (cur_bitmap_size_in_pages * PAGE_SIZE) / sizeof(uint32_t);
-                     i++)
-                    tmp_bitmap[i] = mem_bitmap[i];
-                /* Fill in the rest */
-                for (size_t i = (cur_bitmap_size_in_pages * PAGE_SIZE) / sizeof(uint32_t);
-                     i < (new_bitmap_size_in_pages * PAGE_SIZE) / sizeof(uint32_t);
-                     i++)
-                    tmp_bitmap[i] = 0xffffffff;
-                bitmap_entries += ((PAGE_SIZE / sizeof(uint32_t)) * 32) * BMREALLOC_STEP;
-                uint32_t *old_bitmap = (uint32_t *)((size_t)mem_bitmap - MEM_PHYS_OFFSET);
-                mem_bitmap = tmp_bitmap;
-                pmm_free(old_bitmap, cur_bitmap_size_in_pages);
-            }
+        buddy_free_block(page, order, tail);
 
-            if (e820_map[i].type == 1)
-                write_bitmap(page, 0);
-            else
-                write_bitmap(page, 1);
-        }
+        page += (size_t)1 << order;
+        pg_count -= (size_t)1 << order;
     }
 
     return;
 }
 
-/* Allocate physical memory. */
-void *pmm_alloc(size_t pg_count) {
-    spinlock_acquire(&pmm_lock);
+/* Allocate pg_count contiguous pages out of the buddy free lists.
+ * Returns the first page, or 0 on failure. */
+static size_t buddy_alloc(size_t pg_count) {
+    int order = 0;
+
+    while (((size_t)1 << order) < pg_count)
+        order++;
+
+    if (order >= PMM_MAX_ORDER)
+        return 0;
+
+    /* Find the smallest free block which is large enough */
+    int i;
+    for (i = order; i < PMM_MAX_ORDER; i++) {
+        if (free_counts[i])
+            break;
+    }
+    if (i == PMM_MAX_ORDER)
+        return 0;
+
+    size_t page = node_to_page(free_lists[i].next);
+    buddy_list_remove(i, page);
+
+    /* Split it down, returning the upper halves */
+    while (i > order) {
+        i--;
+        buddy_list_push(i, page + ((size_t)1 << i), 0);
+    }
+
+    /* Give back the pages past pg_count, if it is not a power of 2 */
+    if (pg_count < ((size_t)1 << order))
+        buddy_insert_range(page + pg_count, ((size_t)1 << order) - pg_count, 0);
 
-    /* Allocate contiguous free pages. */
+    write_bitmap_range(page, pg_count, 1);
+
+    return page;
+}
+
+static void buddy_free(size_t page, size_t pg_count) {
+    write_bitmap_range(page, pg_count, 0);
+
+    buddy_insert_range(page, pg_count, 0);
+
+    return;
+}
+
+/* First fit scan of the bitmap. Returns the first page, or 0 on failure. */
+static size_t bitmap_alloc(size_t pg_count) {
     size_t counter = 0;
     size_t i;
     size_t start;
@@ -135,37 +247,693 @@ void *pmm_alloc(size_t pg_count) {
         if (counter == pg_count)
             goto found;
     }
-    spinlock_release(&pmm_lock);
-    return (void *)0;
+    return 0;
 
 found:
     start = i - (pg_count - 1);
-    for (i = start; i < (start + pg_count); i++) {
-        write_bitmap(i, 1);
+    write_bitmap_range(start, pg_count, 1);
+
+    return start;
+}
+
+static void bitmap_free(size_t page, size_t pg_count) {
+    write_bitmap_range(page, pg_count, 0);
+
+    return;
+}
+
+/* The bitmap has to fit in the first 32 MiB, which is all
+ * the boot page tables map before init_vmm() */
+#define BOOT_MAP_LIMIT 0x2000000
+
+struct pmm_region_t {
+    size_t base;
+    size_t end;
+};
+
+/* Usable memory, in pages, sorted and merged */
+static struct pmm_region_t usable_regions[256];
+static size_t usable_regions_i = 0;
+
+static uint64_t init_pmm_cycles;
+
+/* Populate bitmap using e820 data. */
+void init_pmm(void) {
+    uint64_t tsc = rdtsc();
+
+    kprint(KPRN_INFO, "pmm: Mapping memory as specified by the e820...");
+
+    /* Collect the page aligned usable regions, in ascending order */
+    for (size_t i = 0; e820_map[i].type; i++) {
+        if (e820_map[i].type != 1)
+            continue;
+
+        size_t base = (e820_map[i].base + PAGE_SIZE - 1) / PAGE_SIZE;
+        size_t end = (e820_map[i].base + e820_map[i].length) / PAGE_SIZE;
+
+        if (base < BITMAP_BASE)
+            base = BITMAP_BASE;
+        if (end <= base)
+            continue;
+
+        size_t j;
+        for (j = usable_regions_i; j && usable_regions[j - 1].base > base; j--)
+            usable_regions[j] = usable_regions[j - 1];
+        usable_regions[j].base = base;
+        usable_regions[j].end = end;
+        usable_regions_i++;
     }
 
+    /* Merge overlapping and adjacent regions */
+    size_t merged = 0;
+    for (size_t i = 0; i < usable_regions_i; i++) {
+        if (merged && usable_regions[i].base <= usable_regions[merged - 1].end) {
+            if (usable_regions[i].end > usable_regions[merged - 1].end)
+                usable_regions[merged - 1].end = usable_regions[i].end;
+            continue;
+        }
+        usable_regions[merged++] = usable_regions[i];
+    }
+    usable_regions_i = merged;
+
+    if (!usable_regions_i) {
+        kprint(KPRN_ERR, "pmm: No usable memory above %X. Halted.", (uint64_t)MEMORY_BASE);
+        for (;;);
+    }
+
+    /* Size the bitmap once, from the highest usable page */
+    bitmap_entries = usable_regions[usable_regions_i - 1].end - BITMAP_BASE;
+    bitmap_entries = ((bitmap_entries + 31) / 32) * 32;
+    size_t bitmap_pages = (bitmap_entries / 8 + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    /* Put it at the start of the first region which can hold it */
+    size_t bitmap_start = 0;
+    for (size_t i = 0; i < usable_regions_i; i++) {
+        if (usable_regions[i].end - usable_regions[i].base < bitmap_pages)
+            continue;
+        if ((usable_regions[i].base + bitmap_pages) * PAGE_SIZE > BOOT_MAP_LIMIT)
+            break;
+        bitmap_start = usable_regions[i].base;
+        break;
+    }
+    if (!bitmap_start) {
+        kprint(KPRN_ERR, "pmm: No room for a %U page bitmap in low memory. Halted.", bitmap_pages);
+        for (;;);
+    }
+
+    mem_bitmap = (volatile uint32_t *)(bitmap_start * PAGE_SIZE + MEM_PHYS_OFFSET);
+
+    for (size_t i = 0; i < bitmap_entries / 32; i++)
+        mem_bitmap[i] = 0xffffffff;
+
+    for (size_t i = 0; i < usable_regions_i; i++)
+        write_bitmap_range(usable_regions[i].base,
+                           usable_regions[i].end - usable_regions[i].base, 0);
+
+    /* Entries which are not usable win over usable ones they overlap */
+    for (size_t i = 0; e820_map[i].type; i++) {
+        if (e820_map[i].type == 1)
+            continue;
+
+        size_t base = e820_map[i].base / PAGE_SIZE;
+        size_t end = (e820_map[i].base + e820_map[i].length + PAGE_SIZE - 1) / PAGE_SIZE;
+
+        if (base < BITMAP_BASE)
+            base = BITMAP_BASE;
+        if (end > BITMAP_BASE + bitmap_entries)
+            end = BITMAP_BASE + bitmap_entries;
+        if (end <= base)
+            continue;
+
+        write_bitmap_range(base, end - base, 1);
+    }
+
+    write_bitmap_range(bitmap_start, bitmap_pages, 1);
+
+    init_pmm_cycles = rdtsc() - tsc;
+
+    kprint(KPRN_INFO, "pmm: %U page bitmap built in %U cycles.", bitmap_pages, init_pmm_cycles);
+
+    return;
+}
+
+/* Hand all the free memory over to the buddy allocator.
+ * Must be called after init_vmm(). */
+void init_pmm_buddy(void) {
+    uint64_t rflags = interrupts_save();
+    spinlock_acquire(&pmm_lock);
+
+    size_t page_limit = BITMAP_BASE + bitmap_entries;
+
+    /* Allocate the per-order bitmaps in one go */
+    size_t total_entries = 0;
+    for (int i = 0; i < PMM_MAX_ORDER; i++) {
+        /* Round up to whole dwords */
+        order_entries[i] = (((page_limit >> i) + 1 + 31) / 32) * 32;
+        total_entries += order_entries[i];
+    }
+
+    size_t bitmaps_size = total_entries / 8;
+    size_t bitmaps_pages = (bitmaps_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t bitmaps_start = bitmap_alloc(bitmaps_pages);
+    if (!bitmaps_start) {
+        kprint(KPRN_ERR, "pmm: Unable to allocate the buddy bitmaps. Halted.");
+        for (;;);
+    }
+
+    size_t db_pages = (bitmap_entries * sizeof(struct page_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t db_start = bitmap_alloc(db_pages);
+    if (!db_start) {
+        kprint(KPRN_ERR, "pmm: Unable to allocate the page frame database. Halted.");
+        for (;;);
+    }
+    page_db = (struct page_t *)(db_start * PAGE_SIZE + MEM_PHYS_OFFSET);
+    /* Whatever is in use already has an owner nobody knows about, so it
+     * must never look unreferenced */
+    for (size_t i = 0; i < bitmap_entries; i++) {
+        page_db[i].refcount = read_bitmap(BITMAP_BASE + i);
+        page_db[i].mapcount = 0;
+        page_db[i].flags = 0;
+        page_db[i].owner = 0;
+    }
+
+    volatile uint32_t *ptr = (volatile uint32_t *)(bitmaps_start * PAGE_SIZE + MEM_PHYS_OFFSET);
+    for (int i = 0; i < PMM_MAX_ORDER; i++) {
+        order_bitmaps[i] = ptr;
+        for (size_t j = 0; j < order_entries[i] / 32; j++)
+            ptr[j] = 0;
+        ptr += order_entries[i] / 32;
+    }
+
+    for (int i = 0; i < PMM_MAX_ORDER; i++) {
+        free_lists[i].next = &free_lists[i];
+        free_lists[i].prev = &free_lists[i];
+        free_counts[i] = 0;
+    }
+
+    /* Insert each run of free pages, in ascending order, so that
+     * low memory is handed out first. */
+    size_t free_pages = 0;
+    for (size_t i = BITMAP_BASE; i < page_limit; ) {
+        if (read_bitmap(i)) {
+            i++;
+            continue;
+        }
+        size_t run = i;
+        while (i < page_limit && !read_bitmap(i))
+            i++;
+        buddy_insert_range(run, i - run, 1);
+        free_pages += i - run;
+    }
+
+    buddy_ready = 1;
+
     spinlock_release(&pmm_lock);
+    interrupts_restore(rflags);
+
+    kprint(KPRN_INFO, "pmm: Buddy allocator ready, %U free pages.", free_pages);
+    kprint(KPRN_INFO, "pmm: Page frame database: %U bytes per page, %U KiB.",
+           sizeof(struct page_t), db_pages * PAGE_SIZE / 1024);
+
+    return;
+}
+
+/* Single page allocation fast path. Interrupts are disabled rather than
+ * taking a lock, so that the thread cannot migrate to another CPU while
+ * it is using the cache. The caches rely on GS pointing to the CPU local,
+ * so they are only used once init_smp() has set that up. */
+static size_t cache_alloc(void) {
+    uint64_t rflags = interrupts_save();
+
+    struct cpu_local_t *cpu_local = &cpu_locals[current_cpu];
+
+    if (!cpu_local->pmm_cache_count) {
+        spinlock_acquire(&pmm_lock);
+        for (size_t i = 0; i < PMM_CACHE_BATCH; i++) {
+            size_t page = buddy_alloc(1);
+            if (!page)
+                break;
+            cpu_local->pmm_cache[cpu_local->pmm_cache_count++] = page;
+        }
+        spinlock_release(&pmm_lock);
+    }
+
+    size_t page = 0;
+    if (cpu_local->pmm_cache_count)
+        page = cpu_local->pmm_cache[--cpu_local->pmm_cache_count];
+
+    interrupts_restore(rflags);
+
+    return page;
+}
 
-    uint64_t *pages = (uint64_t *)((start * PAGE_SIZE) + MEM_PHYS_OFFSET);
+static void cache_free(size_t page) {
+    uint64_t rflags = interrupts_save();
 
-    for (size_t i = 0; i < (pg_count * PAGE_SIZE) / sizeof(uint64_t); i++)
-        pages[i] = 0;
+    struct cpu_local_t *cpu_local = &cpu_locals[current_cpu];
+
+    if (cpu_local->pmm_cache_count == PMM_CACHE_SIZE) {
+        /* Drain the oldest half of the cache */
+        spinlock_acquire(&pmm_lock);
+        for (size_t i = 0; i < PMM_CACHE_BATCH; i++)
+            buddy_free(cpu_local->pmm_cache[i], 1);
+        spinlock_release(&pmm_lock);
+        for (size_t i = PMM_CACHE_BATCH; i < PMM_CACHE_SIZE; i++)
+            cpu_local->pmm_cache[i - PMM_CACHE_BATCH] = cpu_local->pmm_cache[i];
+        cpu_local->pmm_cache_count -= PMM_CACHE_BATCH;
+    }
+
+    cpu_local->pmm_cache[cpu_local->pmm_cache_count++] = page;
+
+    interrupts_restore(rflags);
+
+    return;
+}
+
+/* Pages zeroed ahead of time by idle CPUs, linked through their first qword,
+ * which is cleared again when the page is handed out. */
+#define ZERO_POOL_SIZE 1024
+
+static lock_t zero_pool_lock = 1;
+static size_t zero_pool = 0;
+static volatile size_t zero_pool_count = 0;
+
+static inline void zero_pages(size_t page, size_t pg_count) {
+    asm volatile (
+        "rep stosq;"
+        :
+        : "D" (page * PAGE_SIZE + MEM_PHYS_OFFSET),
+          "c" ((pg_count * PAGE_SIZE) / sizeof(uint64_t)),
+          "a" (0)
+        : "memory"
+    );
+}
+
+static size_t zero_pool_pop(void) {
+    uint64_t rflags = interrupts_save();
+    spinlock_acquire(&zero_pool_lock);
+
+    size_t page = zero_pool;
+    if (page) {
+        size_t *link = (size_t *)(page * PAGE_SIZE + MEM_PHYS_OFFSET);
+        zero_pool = *link;
+        *link = 0;
+        zero_pool_count--;
+    }
+
+    spinlock_release(&zero_pool_lock);
+    interrupts_restore(rflags);
+
+    return page;
+}
+
+/* Give all the pooled pages back, when memory is running short */
+static void zero_pool_drain(void) {
+    size_t page;
+
+    while ((page = zero_pool_pop())) {
+        uint64_t rflags = interrupts_save();
+        spinlock_acquire(&pmm_lock);
+        buddy_free(page, 1);
+        spinlock_release(&pmm_lock);
+        interrupts_restore(rflags);
+    }
+
+    return;
+}
+
+/* Called by idle CPUs with interrupts enabled. The CPU may be rescheduled
+ * at any point, so the page being zeroed is kept in the CPU local and
+ * picked up again the next time this CPU is idle. */
+void pmm_zero_idle(void) {
+    if (!cpu_locals_ready)
+        return;
+
+    struct cpu_local_t *cpu_local = &cpu_locals[current_cpu];
+
+    for (;;) {
+        if (!cpu_local->pmm_zero_page) {
+            if (zero_pool_count >= ZERO_POOL_SIZE)
+                return;
+            uint64_t rflags = interrupts_save();
+            cpu_local->pmm_zero_page = cache_alloc();
+            interrupts_restore(rflags);
+            if (!cpu_local->pmm_zero_page)
+                return;
+        }
+
+        zero_pages(cpu_local->pmm_zero_page, 1);
+
+        uint64_t rflags = interrupts_save();
+        spinlock_acquire(&zero_pool_lock);
+        *(size_t *)(cpu_local->pmm_zero_page * PAGE_SIZE + MEM_PHYS_OFFSET) = zero_pool;
+        zero_pool = cpu_local->pmm_zero_page;
+        zero_pool_count++;
+        spinlock_release(&zero_pool_lock);
+        cpu_local->pmm_zero_page = 0;
+        interrupts_restore(rflags);
+    }
+}
+
+static size_t pmm_alloc_pages(size_t pg_count) {
+    size_t start;
+
+    if (pg_count == 1 && cpu_locals_ready) {
+        start = cache_alloc();
+        /* The cache could not be refilled, maybe other
+         * CPUs are holding on to the last free pages */
+        if (!start) {
+            uint64_t rflags = interrupts_save();
+            spinlock_acquire(&pmm_lock);
+            start = buddy_alloc(1);
+            spinlock_release(&pmm_lock);
+            interrupts_restore(rflags);
+        }
+    } else {
+        uint64_t rflags = interrupts_save();
+        spinlock_acquire(&pmm_lock);
+
+        if (buddy_ready)
+            start = buddy_alloc(pg_count);
+        else
+            start = bitmap_alloc(pg_count);
+
+        spinlock_release(&pmm_lock);
+        interrupts_restore(rflags);
+    }
+
+    return start;
+}
+
+/* Freshly allocated pages belong to the caller alone */
+static void init_page_metadata(size_t start, size_t pg_count) {
+    if (!page_db)
+        return;
+
+    for (size_t i = 0; i < pg_count; i++) {
+        struct page_t *page = &page_db[start + i - BITMAP_BASE];
+        page->refcount = 1;
+        page->flags = 0;
+        page->owner = 0;
+    }
+}
+
+/* Allocate physical memory. Unless PMM_NOZERO is passed, the memory is zeroed. */
+void *pmm_alloc_flags(size_t pg_count, int flags) {
+    size_t start;
+
+    /* Zeroed single pages come from the pool, if possible. The count is
+     * read without the lock, so that an empty pool costs no shared lock
+     * on the per-CPU cache path. */
+    if (pg_count == 1 && !(flags & PMM_NOZERO) && zero_pool_count
+     && (start = zero_pool_pop())) {
+        init_page_metadata(start, 1);
+        return (void *)(start * PAGE_SIZE);
+    }
+
+    if (!(start = pmm_alloc_pages(pg_count))) {
+        if (!zero_pool_count)
+            return (void *)0;
+        zero_pool_drain();
+        if (!(start = pmm_alloc_pages(pg_count)))
+            return (void *)0;
+    }
+
+    if (!(flags & PMM_NOZERO))
+        zero_pages(start, pg_count);
+
+    init_page_metadata(start, pg_count);
 
     /* Return the physical address that represents the start of this physical page(s). */
     return (void *)(start * PAGE_SIZE);
 }
 
+/* Allocate zeroed physical memory. */
+void *pmm_alloc(size_t pg_count) {
+    return pmm_alloc_flags(pg_count, 0);
+}
+
+static void release_page_metadata(size_t start, size_t pg_count) {
+    if (!page_db)
+        return;
+
+    for (size_t i = 0; i < pg_count; i++) {
+        struct page_t *page = &page_db[start + i - BITMAP_BASE];
+        if (page->mapcount)
+            kprint(KPRN_WARN, "pmm: Freeing page %X, which is still mapped",
+                   (start + i) * PAGE_SIZE);
+        page->refcount = 0;
+        page->flags = 0;
+    }
+}
+
 /* Release physical memory. */
 void pmm_free(void *ptr, size_t pg_count) {
+    size_t start = (size_t)ptr / PAGE_SIZE;
+
+    release_page_metadata(start, pg_count);
+
+    if (pg_count == 1 && cpu_locals_ready) {
+        cache_free(start);
+        return;
+    }
+
+    uint64_t rflags = interrupts_save();
     spinlock_acquire(&pmm_lock);
 
-    size_t start = (size_t)ptr / PAGE_SIZE;
+    if (buddy_ready)
+        buddy_free(start, pg_count);
+    else
+        bitmap_free(start, pg_count);
+
+    spinlock_release(&pmm_lock);
+    interrupts_restore(rflags);
+
+    return;
+}
+
+/* Release `count` single pages, given by physical address, at once. They
+ * go straight back to the buddy allocator under a single acquisition of
+ * the lock, rather than through the CPU's cache. */
+void pmm_free_batch(size_t *pages, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        release_page_metadata(pages[i] / PAGE_SIZE, 1);
+
+    uint64_t rflags = interrupts_save();
+    spinlock_acquire(&pmm_lock);
 
-    for (size_t i = start; i < (start + pg_count); i++) {
-        write_bitmap(i, 0);
+    for (size_t i = 0; i < count; i++) {
+        if (buddy_ready)
+            buddy_free(pages[i] / PAGE_SIZE, 1);
+        else
+            bitmap_free(pages[i] / PAGE_SIZE, 1);
     }
 
     spinlock_release(&pmm_lock);
+    interrupts_restore(rflags);
+}
+
+static inline uint32_t atomic_add32(volatile uint32_t *ptr, uint32_t val) {
+    asm volatile (
+        "lock xadd dword ptr ds:[rbx], eax;"
+        : "+a" (val)
+        : "b" (ptr)
+        : "memory"
+    );
+
+    return val;
+}
+
+/* The metadata of the page at a physical address, or NULL if the page
+ * is not managed by the PMM */
+struct page_t *pmm_page(size_t phys) {
+    size_t pfn = phys / PAGE_SIZE;
+
+    if (!page_db || pfn < BITMAP_BASE || pfn >= BITMAP_BASE + bitmap_entries)
+        return (void *)0;
+
+    return &page_db[pfn - BITMAP_BASE];
+}
+
+/* Take another reference to a page. Pages the PMM does not manage, such as
+ * MMIO, are not reference counted: they are never shared and never freed. */
+void pmm_ref(void *ptr) {
+    struct page_t *page = pmm_page((size_t)ptr);
+
+    if (page)
+        atomic_add32(&page->refcount, 1);
+}
+
+/* Drop a reference to a page. Returns 1 if it was the last one, in which case
+ * the caller is to free the page. */
+int pmm_unref(void *ptr) {
+    struct page_t *page = pmm_page((size_t)ptr);
+
+    if (!page)
+        return 0;
+
+    return atomic_add32(&page->refcount, (uint32_t)-1) == 1;
+}
+
+/* Whether a page has more than one owner */
+int pmm_shared(void *ptr) {
+    struct page_t *page = pmm_page((size_t)ptr);
+
+    if (!page)
+        return 0;
+
+    return page->refcount > 1;
+}
+
+/* Account for a page table entry mapping, or no longer mapping, a page.
+ * Pages the PMM does not manage are ignored. */
+void pmm_mapcount_add(size_t phys, int delta) {
+    struct page_t *page = pmm_page(phys);
+
+    if (page)
+        atomic_add32(&page->mapcount, (uint32_t)delta);
+}
+
+#define LEGACY_BMREALLOC_STEP 1
+
+/* The bitmap construction init_pmm() used to do: grow the bitmap one page
+ * at a time and mark pages one bit at a time. It builds a throwaway bitmap
+ * so that its cost can be compared with the current one. */
+static uint64_t pmm_bench_legacy_init(void) {
+    uint64_t tsc = rdtsc();
+
+    volatile uint32_t *bitmap = pmm_alloc(LEGACY_BMREALLOC_STEP);
+    if (!bitmap)
+        return 0;
+    bitmap = (volatile uint32_t *)((size_t)bitmap + MEM_PHYS_OFFSET);
+
+    for (size_t i = 0; i < (LEGACY_BMREALLOC_STEP * PAGE_SIZE) / sizeof(uint32_t); i++)
+        bitmap[i] = 0xffffffff;
+
+    size_t entries = ((PAGE_SIZE / sizeof(uint32_t)) * 32) * LEGACY_BMREALLOC_STEP;
+
+    for (size_t i = 0; e820_map[i].type; i++) {
+        size_t aligned_base;
+        if (e820_map[i].base % PAGE_SIZE)
+            aligned_base = e820_map[i].base + (PAGE_SIZE - (e820_map[i].base % PAGE_SIZE));
+        else
+            aligned_base = e820_map[i].base;
+        size_t aligned_length = (e820_map[i].length / PAGE_SIZE) * PAGE_SIZE;
+        if ((e820_map[i].base % PAGE_SIZE) && aligned_length) aligned_length -= PAGE_SIZE;
+
+        for (size_t j = 0; j * PAGE_SIZE < aligned_length; j++) {
+            size_t addr = aligned_base + j * PAGE_SIZE;
+
+            size_t page = addr / PAGE_SIZE - BITMAP_BASE;
+
+            if (addr < (MEMORY_BASE + PAGE_SIZE))
+                continue;
+
+            if (addr >= (MEMORY_BASE + entries * PAGE_SIZE)) {
+                size_t cur_pages = ((entries / 32) * sizeof(uint32_t)) / PAGE_SIZE;
+                size_t new_pages = cur_pages + LEGACY_BMREALLOC_STEP;
+                volatile uint32_t *new_bitmap = pmm_alloc(new_pages);
+                if (!new_bitmap) {
+                    pmm_free((void *)((size_t)bitmap - MEM_PHYS_OFFSET), cur_pages);
+                    return 0;
+                }
+                new_bitmap = (volatile uint32_t *)((size_t)new_bitmap + MEM_PHYS_OFFSET);
+                for (size_t k = 0; k < (cur_pages * PAGE_SIZE) / sizeof(uint32_t); k++)
+                    new_bitmap[k] = bitmap[k];
+                for (size_t k = (cur_pages * PAGE_SIZE) / sizeof(uint32_t);
+                     k < (new_pages * PAGE_SIZE) / sizeof(uint32_t);
+                     k++)
+                    new_bitmap[k] = 0xffffffff;
+                entries += ((PAGE_SIZE / sizeof(uint32_t)) * 32) * LEGACY_BMREALLOC_STEP;
+                pmm_free((void *)((size_t)bitmap - MEM_PHYS_OFFSET), cur_pages);
+                bitmap = new_bitmap;
+            }
+
+            if (e820_map[i].type == 1)
+                bitmap[page / 32] &= ~(1 << (page % 32));
+            else
+                bitmap[page / 32] |= (1 << (page % 32));
+        }
+    }
+
+    uint64_t cycles = rdtsc() - tsc;
+
+    pmm_free((void *)((size_t)bitmap - MEM_PHYS_OFFSET), ((entries / 32) * sizeof(uint32_t)) / PAGE_SIZE);
+
+    return cycles;
+}
+
+#define PMM_BENCH_FILL 16384
+#define PMM_BENCH_ITERATIONS 1024
+
+static void pmm_bench_run(const char *name, size_t (*alloc)(size_t),
+                          void (*free)(size_t, size_t), size_t pg_count) {
+    uint64_t start = rdtsc();
+
+    for (size_t i = 0; i < PMM_BENCH_ITERATIONS; i++) {
+        size_t page = alloc(pg_count);
+        if (!page) {
+            kprint(KPRN_WARN, "pmm: bench: %s: allocation of %U pages failed", name, pg_count);
+            return;
+        }
+        free(page, pg_count);
+    }
+
+    uint64_t cycles = rdtsc() - start;
+
+    kprint(KPRN_INFO, "pmm: bench: %s: %U page(s): %U cycles per alloc/free",
+           name, pg_count, cycles / PMM_BENCH_ITERATIONS);
+
+    return;
+}
+
+/* Compare the buddy allocator against the old bitmap scan, with the low
+ * memory fragmented by a checkerboard of single page allocations. */
+void pmm_bench(void) {
+    uint64_t rflags = interrupts_save();
+    spinlock_acquire(&pmm_lock);
+
+    /* The fill pages are chained through their first qword */
+    size_t chain = 0;
+    for (size_t i = 0; i < PMM_BENCH_FILL; i++) {
+        size_t page = buddy_alloc(1);
+        if (!page)
+            break;
+        *(size_t *)(page * PAGE_SIZE + MEM_PHYS_OFFSET) = chain;
+        chain = page;
+    }
+
+    /* Free every other page to leave holes */
+    size_t kept = 0;
+    for (size_t page = chain, i = 0; page; i++) {
+        size_t next = *(size_t *)(page * PAGE_SIZE + MEM_PHYS_OFFSET);
+        if (i % 2) {
+            buddy_free(page, 1);
+        } else {
+            *(size_t *)(page * PAGE_SIZE + MEM_PHYS_OFFSET) = kept;
+            kept = page;
+        }
+        page = next;
+    }
+
+    pmm_bench_run("bitmap", bitmap_alloc, bitmap_free, 1);
+    pmm_bench_run("buddy", buddy_alloc, buddy_free, 1);
+    pmm_bench_run("bitmap", bitmap_alloc, bitmap_free, 16);
+    pmm_bench_run("buddy", buddy_alloc, buddy_free, 16);
+    pmm_bench_run("bitmap", bitmap_alloc, bitmap_free, 512);
+    pmm_bench_run("buddy", buddy_alloc, buddy_free, 512);
+
+    while (kept) {
+        size_t next = *(size_t *)(kept * PAGE_SIZE + MEM_PHYS_OFFSET);
+        buddy_free(kept, 1);
+        kept = next;
+    }
+
+    spinlock_release(&pmm_lock);
+    interrupts_restore(rflags);
+
+    kprint(KPRN_INFO, "pmm: bench: bitmap construction: %U cycles, was %U cycles",
+           init_pmm_cycles, pmm_bench_legacy_init());
 
     return;
 }
@@ -0,0 +1,159 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <mm.h>
+#include <shm.h>
+#include <vma.h>
+#include <tlb.h>
+#include <klib.h>
+#include <lock.h>
+
+/* A named shared memory segment. The segment holds a reference to each of
+ * its pages, and every mapping of a page holds another one, so the pages
+ * are freed by whichever of the last close and the last unmap comes last. */
+struct shm_segment_t {
+    char name[SHM_NAME_MAX];
+    size_t pages;
+    size_t *frames;
+    /* Handles open on the segment, 0 if the slot is free */
+    int refcount;
+};
+
+static struct shm_segment_t segments[SHM_MAX_SEGMENTS];
+/* Held with interrupts disabled, as vma_map_shared() takes the pagemap's
+ * locks under it */
+static lock_t shm_lock = 1;
+
+static void free_frames(size_t *frames, size_t pages) {
+    for (size_t i = 0; i < pages; i++) {
+        if (pmm_unref((void *)frames[i]))
+            pmm_free((void *)frames[i], 1);
+    }
+    kfree(frames);
+}
+
+/* Open the segment called `name`, creating it with `size` bytes of zeroed
+ * memory if it does not exist and SHM_CREATE is passed. */
+/* Returns the segment id, -1 on failure */
+int shm_open(const char *name, size_t size, int flags) {
+    int id, free_id = -1;
+
+    if (!*name || kstrlen(name) >= SHM_NAME_MAX)
+        return -1;
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&shm_lock);
+
+    for (id = 0; id < SHM_MAX_SEGMENTS; id++) {
+        if (!segments[id].refcount) {
+            if (free_id == -1)
+                free_id = id;
+            continue;
+        }
+        if (!kstrcmp(segments[id].name, name)) {
+            segments[id].refcount++;
+            goto out;
+        }
+    }
+
+    id = -1;
+    if (!(flags & SHM_CREATE) || !size || free_id == -1)
+        goto out;
+
+    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t *frames = kalloc(pages * sizeof(size_t));
+    if (!frames)
+        goto out;
+
+    for (size_t i = 0; i < pages; i++) {
+        void *page = pmm_alloc(1);
+        if (!page) {
+            free_frames(frames, i);
+            goto out;
+        }
+        struct page_t *meta = pmm_page((size_t)page);
+        meta->flags |= PG_SHM;
+        meta->owner = (uint16_t)free_id;
+        frames[i] = (size_t)page;
+    }
+
+    id = free_id;
+    kstrcpy(segments[id].name, name);
+    segments[id].pages = pages;
+    segments[id].frames = frames;
+    segments[id].refcount = 1;
+
+out:
+    spinlock_release(&shm_lock);
+    interrupts_restore(rflags);
+    return id;
+}
+
+/* Map the whole of an open segment into `pagemap`, at the first free range
+ * at or above `hint`. Writes through the mapping are seen by every other
+ * mapping of the segment, including the ones of forked processes. */
+/* Returns the address of the mapping, 0 on failure */
+size_t shm_map(struct pagemap_t *pagemap, int id, size_t hint, int prot) {
+    size_t base = 0;
+
+    if (id < 0 || id >= SHM_MAX_SEGMENTS)
+        return 0;
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&shm_lock);
+
+    if (segments[id].refcount)
+        base = vma_map_shared(pagemap, hint, segments[id].frames,
+                              segments[id].pages, prot);
+
+    spinlock_release(&shm_lock);
+    interrupts_restore(rflags);
+    return base;
+}
+
+/* Open another handle to an open segment, for a forked process */
+/* Returns the segment id, -1 on failure */
+int shm_dup(int id) {
+    if (id < 0 || id >= SHM_MAX_SEGMENTS)
+        return -1;
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&shm_lock);
+
+    if (segments[id].refcount)
+        segments[id].refcount++;
+    else
+        id = -1;
+
+    spinlock_release(&shm_lock);
+    interrupts_restore(rflags);
+    return id;
+}
+
+/* Close a handle to a segment. The last close removes the segment's name,
+ * and frees the pages which are not mapped anywhere anymore; the others go
+ * away as they get unmapped. */
+/* Returns 0 on success, -1 on failure */
+int shm_close(int id) {
+    if (id < 0 || id >= SHM_MAX_SEGMENTS)
+        return -1;
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&shm_lock);
+
+    if (!segments[id].refcount) {
+        spinlock_release(&shm_lock);
+        interrupts_restore(rflags);
+        return -1;
+    }
+
+    if (!--segments[id].refcount) {
+        free_frames(segments[id].frames, segments[id].pages);
+        segments[id].frames = (void *)0;
+        segments[id].pages = 0;
+        segments[id].name[0] = 0;
+    }
+
+    spinlock_release(&shm_lock);
+    interrupts_restore(rflags);
+    return 0;
+}
@@ -0,0 +1,296 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <slab.h>
+#include <mm.h>
+#include <klib.h>
+#include <lock.h>
+#include <smp.h>
+#include <panic.h>
+
+#define SLAB_HEADER_SIZE 64
+#define SLAB_MAX_CACHES 32
+
+/* Objects each CPU keeps on hand, moved from and to the slabs
+ * SLAB_CPU_BATCH at a time */
+#define SLAB_CPU_SIZE 16
+#define SLAB_CPU_BATCH 8
+
+/* Lives in the first SLAB_HEADER_SIZE bytes of the slab page */
+struct slab_t {
+    struct slab_cache_t *cache;
+    struct slab_t *next;
+    struct slab_t *prev;
+    void *free;
+    size_t in_use;
+};
+
+/* Each on cache lines of its own, so that CPUs do not contend for them */
+struct slab_cpu_t {
+    size_t count;
+    /* Objects handed out minus objects returned on this CPU,
+     * summed over all CPUs for the usage report */
+    int64_t in_use;
+    void *objects[SLAB_CPU_SIZE];
+} __attribute__((aligned(64)));
+
+struct slab_cache_t {
+    char name[32];
+    size_t size;
+    size_t per_slab;
+    lock_t lock;
+    /* Slabs with at least one free object */
+    struct slab_t partial;
+    size_t slabs;
+    size_t empty_slabs;
+    struct slab_cpu_t cpu[MAX_CPUS];
+};
+
+static struct slab_cache_t *caches[SLAB_MAX_CACHES];
+static size_t caches_i = 0;
+static lock_t caches_lock = 1;
+
+/* kalloc() size classes, 16 bytes to SLAB_MAX_SIZE */
+#define KALLOC_MIN_SHIFT 4
+#define KALLOC_CLASSES 8
+
+static struct slab_cache_t *kalloc_caches[KALLOC_CLASSES];
+
+static inline void slab_list_remove(struct slab_t *slab) {
+    slab->prev->next = slab->next;
+    slab->next->prev = slab->prev;
+    slab->next = slab;
+    slab->prev = slab;
+}
+
+static inline void slab_list_insert(struct slab_t *head, struct slab_t *slab) {
+    slab->next = head->next;
+    slab->prev = head;
+    head->next->prev = slab;
+    head->next = slab;
+}
+
+struct slab_cache_t *slab_cache_create(const char *name, size_t size) {
+    /* Keep objects 16 byte aligned, for the likes of fxsave areas */
+    size = (size + 15) & ~(size_t)15;
+
+    if (!size || size > PAGE_SIZE - SLAB_HEADER_SIZE)
+        return (void *)0;
+
+    size_t pages = (sizeof(struct slab_cache_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    void *ptr = pmm_alloc(pages);
+    if (!ptr)
+        return (void *)0;
+
+    struct slab_cache_t *cache = (struct slab_cache_t *)((size_t)ptr + MEM_PHYS_OFFSET);
+
+    size_t i;
+    for (i = 0; name[i] && i < sizeof(cache->name) - 1; i++)
+        cache->name[i] = name[i];
+    cache->name[i] = 0;
+
+    cache->size = size;
+    cache->per_slab = (PAGE_SIZE - SLAB_HEADER_SIZE) / size;
+    cache->partial.next = &cache->partial;
+    cache->partial.prev = &cache->partial;
+    spinlock_release(&cache->lock);
+
+    spinlock_acquire(&caches_lock);
+    if (caches_i < SLAB_MAX_CACHES)
+        caches[caches_i++] = cache;
+    spinlock_release(&caches_lock);
+
+    return cache;
+}
+
+/* Add a fresh slab to the cache. Cache lock must be held. */
+static struct slab_t *slab_grow(struct slab_cache_t *cache) {
+    void *ptr = pmm_alloc_flags(1, PMM_NOZERO);
+    if (!ptr)
+        return (void *)0;
+
+    struct slab_t *slab = (struct slab_t *)((size_t)ptr + MEM_PHYS_OFFSET);
+
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free = (void *)0;
+
+    /* Build the free list back to front, so objects are handed out in order */
+    for (size_t i = cache->per_slab; i; i--) {
+        void **obj = (void **)((size_t)slab + SLAB_HEADER_SIZE + (i - 1) * cache->size);
+        *obj = slab->free;
+        slab->free = obj;
+    }
+
+    slab_list_insert(&cache->partial, slab);
+    cache->slabs++;
+    cache->empty_slabs++;
+
+    return slab;
+}
+
+/* Take an object out of the slabs. Cache lock must be held. */
+static void *slab_get(struct slab_cache_t *cache) {
+    struct slab_t *slab = cache->partial.next;
+
+    if (slab == &cache->partial) {
+        if (!(slab = slab_grow(cache)))
+            return (void *)0;
+    }
+
+    void **obj = slab->free;
+    slab->free = *obj;
+
+    if (!slab->in_use++)
+        cache->empty_slabs--;
+    if (!slab->free)
+        slab_list_remove(slab);
+
+    return obj;
+}
+
+/* Give an object back to its slab, releasing the slab if it becomes empty
+ * and the cache already has an empty slab to spare. Cache lock must be held. */
+static void slab_put(struct slab_cache_t *cache, void *ptr) {
+    struct slab_t *slab = (struct slab_t *)((size_t)ptr & ~(PAGE_SIZE - 1));
+    void **obj = ptr;
+
+    if (!slab->free)
+        slab_list_insert(&cache->partial, slab);
+
+    *obj = slab->free;
+    slab->free = obj;
+
+    if (!--slab->in_use) {
+        if (cache->empty_slabs) {
+            slab_list_remove(slab);
+            cache->slabs--;
+            pmm_free((void *)((size_t)slab - MEM_PHYS_OFFSET), 1);
+        } else {
+            cache->empty_slabs++;
+        }
+    }
+
+    return;
+}
+
+/* Allocate a zeroed object. Interrupts are disabled while the CPU's
+ * objects are used, so the thread cannot migrate in the meantime. */
+void *slab_alloc(struct slab_cache_t *cache) {
+    void *obj;
+
+    uint64_t rflags = interrupts_save();
+
+    if (cpu_locals_ready) {
+        struct slab_cpu_t *cpu = &cache->cpu[current_cpu];
+
+        if (!cpu->count) {
+            spinlock_acquire(&cache->lock);
+            while (cpu->count < SLAB_CPU_BATCH && (obj = slab_get(cache)))
+                cpu->objects[cpu->count++] = obj;
+            spinlock_release(&cache->lock);
+        }
+
+        obj = cpu->count ? cpu->objects[--cpu->count] : (void *)0;
+        if (obj)
+            cpu->in_use++;
+    } else {
+        spinlock_acquire(&cache->lock);
+        obj = slab_get(cache);
+        spinlock_release(&cache->lock);
+        if (obj)
+            cache->cpu[0].in_use++;
+    }
+
+    interrupts_restore(rflags);
+
+    if (obj)
+        kmemset(obj, 0, cache->size);
+
+    return obj;
+}
+
+void slab_free(void *ptr) {
+    struct slab_t *slab = (struct slab_t *)((size_t)ptr & ~(PAGE_SIZE - 1));
+    struct slab_cache_t *cache = slab->cache;
+
+    uint64_t rflags = interrupts_save();
+
+    if (cpu_locals_ready) {
+        struct slab_cpu_t *cpu = &cache->cpu[current_cpu];
+
+        if (cpu->count == SLAB_CPU_SIZE) {
+            /* Return the oldest objects to their slabs */
+            spinlock_acquire(&cache->lock);
+            for (size_t i = 0; i < SLAB_CPU_BATCH; i++)
+                slab_put(cache, cpu->objects[i]);
+            spinlock_release(&cache->lock);
+            for (size_t i = SLAB_CPU_BATCH; i < SLAB_CPU_SIZE; i++)
+                cpu->objects[i - SLAB_CPU_BATCH] = cpu->objects[i];
+            cpu->count -= SLAB_CPU_BATCH;
+        }
+
+        cpu->objects[cpu->count++] = ptr;
+        cpu->in_use--;
+    } else {
+        spinlock_acquire(&cache->lock);
+        slab_put(cache, ptr);
+        spinlock_release(&cache->lock);
+        cache->cpu[0].in_use--;
+    }
+
+    interrupts_restore(rflags);
+
+    return;
+}
+
+size_t slab_object_size(void *ptr) {
+    struct slab_t *slab = (struct slab_t *)((size_t)ptr & ~(PAGE_SIZE - 1));
+
+    return slab->cache->size;
+}
+
+void *slab_kalloc(size_t size) {
+    size_t class = 0;
+
+    while (((size_t)1 << (class + KALLOC_MIN_SHIFT)) < size)
+        class++;
+
+    return slab_alloc(kalloc_caches[class]);
+}
+
+void slab_report(void) {
+    spinlock_acquire(&caches_lock);
+
+    for (size_t i = 0; i < caches_i; i++) {
+        struct slab_cache_t *cache = caches[i];
+
+        int64_t in_use = 0;
+        for (int j = 0; j < MAX_CPUS; j++)
+            in_use += cache->cpu[j].in_use;
+
+        kprint(KPRN_INFO, "slab: %s: %U byte objects, %U in use, %U slabs (%U KiB)",
+               cache->name, cache->size, (uint64_t)in_use, cache->slabs,
+               cache->slabs * PAGE_SIZE / 1024);
+    }
+
+    spinlock_release(&caches_lock);
+
+    return;
+}
+
+void init_slab(void) {
+    static const char *names[KALLOC_CLASSES] = {
+        "kalloc-16", "kalloc-32", "kalloc-64", "kalloc-128",
+        "kalloc-256", "kalloc-512", "kalloc-1024", "kalloc-2048"
+    };
+
+    for (size_t i = 0; i < KALLOC_CLASSES; i++) {
+        kalloc_caches[i] = slab_cache_create(names[i], (size_t)1 << (i + KALLOC_MIN_SHIFT));
+        if (!kalloc_caches[i])
+            panic("slab: Unable to create the kalloc caches", 0, 0);
+    }
+
+    kprint(KPRN_INFO, "slab: Initialised %u kalloc size classes.", KALLOC_CLASSES);
+
+    return;
+}
@@ -0,0 +1,309 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <cpuid.h>
+#include <mm.h>
+#include <tlb.h>
+#include <smp.h>
+#include <apic.h>
+#include <ipi.h>
+#include <lock.h>
+#include <klib.h>
+
+#define CR4_PGE ((size_t)1 << 7)
+#define CR4_PCIDE ((size_t)1 << 17)
+
+/* Loading CR3 with this bit set keeps the TLB entries tagged with the PCID */
+#define CR3_NOFLUSH ((size_t)1 << 63)
+
+#define read_cr4() ({ \
+    size_t cr4; \
+    asm volatile ("mov rax, cr4;" : "=a" (cr4)); \
+    cr4; \
+})
+
+#define load_cr4(NEW_CR4) ({ \
+    asm volatile ("mov cr4, rax;" : : "a" (NEW_CR4) : "memory"); \
+})
+
+/* IPIs sent, and CPUs which needed no IPI because they were not running
+ * the address space or already had one on the way */
+lock_t tlb_shootdowns_sent = 0;
+lock_t tlb_shootdowns_avoided = 0;
+
+pt_entry_t tlb_global_flag = 0;
+
+static int pge_enabled = 0;
+static int pcid_enabled = 0;
+
+static lock_t tlb_generation = 0;
+
+/* Returns a generation number no pagemap has used before */
+size_t tlb_new_generation(void) {
+    size_t gen = 1;
+
+    asm volatile (
+        "lock xadd qword ptr ds:[rbx], rax;"
+        : "+a" (gen)
+        : "b" (&tlb_generation)
+        : "memory"
+    );
+
+    return gen + 1;
+}
+
+/* Flush everything, including the global pages and the other PCIDs */
+static void tlb_flush_all(void) {
+    if (pge_enabled) {
+        size_t cr4 = read_cr4();
+        load_cr4(cr4 & ~CR4_PGE);
+        load_cr4(cr4);
+    } else {
+        load_cr3(read_cr3());
+    }
+}
+
+static void tlb_flush_local(size_t virt_addr, size_t pages) {
+    if (pages > TLB_FLUSH_THRESHOLD) {
+        /* The higher half is global, reloading CR3 would not flush it */
+        if (virt_addr >= MEM_PHYS_OFFSET)
+            tlb_flush_all();
+        else
+            load_cr3(read_cr3());
+        return;
+    }
+
+    for (size_t i = 0; i < pages; i++)
+        invlpg(virt_addr + i * PAGE_SIZE);
+}
+
+/* Whether a mapping may be cached in this CPU's TLB. The higher half is
+ * shared by every pagemap, so it always is. */
+static int is_active_mapping(struct pagemap_t *pagemap, size_t virt_addr) {
+    if (virt_addr >= MEM_PHYS_OFFSET)
+        return 1;
+    if (cpu_locals_ready)
+        return cpu_locals[current_cpu].active_pagemap == pagemap;
+    return (size_t)pagemap->pml4 - MEM_PHYS_OFFSET == (read_cr3() & 0xfffffffffffff000);
+}
+
+/* Perform the invalidations queued for this CPU. Interrupts should be OFF */
+static void tlb_drain_queue(void) {
+    struct tlb_queue_t *queue = &cpu_locals[current_cpu].tlb_queue;
+    struct tlb_request_t requests[TLB_QUEUE_SIZE];
+
+    spinlock_acquire(&queue->lock);
+    size_t count = queue->count;
+    int flush_all = queue->flush_all;
+    size_t batch = queue->queued;
+    kmemcpy(requests, queue->requests, count * sizeof(struct tlb_request_t));
+    queue->count = 0;
+    queue->flush_all = 0;
+    queue->ipi_pending = 0;
+    spinlock_release(&queue->lock);
+
+    if (flush_all) {
+        tlb_flush_all();
+    } else {
+        for (size_t i = 0; i < count; i++)
+            tlb_flush_local(requests[i].virt_addr, requests[i].pages);
+    }
+
+    queue->completed = batch;
+}
+
+/* Called by the IPI_TLB stub */
+void tlb_shootdown_handler(void) {
+    tlb_drain_queue();
+    lapic_eoi();
+}
+
+/* Invalidate a range of `pagemap` on every other CPU which might have it
+ * cached, and wait for them to be done */
+static void tlb_shootdown(struct pagemap_t *pagemap, size_t virt_addr, size_t pages) {
+    size_t waits[MAX_CPUS];
+
+    if (!cpu_locals_ready || smp_cpu_count == 1)
+        return;
+
+    int self = current_cpu;
+
+    /* Make the page table changes visible before looking at which
+     * address space each CPU is running */
+    asm volatile ("mfence" ::: "memory");
+
+    for (int i = 0; i < smp_cpu_count; i++) {
+        waits[i] = 0;
+        if (i == self)
+            continue;
+
+        /* The higher half is shared, every CPU may have it cached */
+        if (virt_addr < MEM_PHYS_OFFSET && cpu_locals[i].active_pagemap != pagemap) {
+            spinlock_inc(&tlb_shootdowns_avoided);
+            continue;
+        }
+
+        struct tlb_queue_t *queue = &cpu_locals[i].tlb_queue;
+
+        uint64_t rflags = interrupts_save();
+        spinlock_acquire(&queue->lock);
+
+        if (pages > TLB_FLUSH_THRESHOLD || queue->count == TLB_QUEUE_SIZE) {
+            queue->flush_all = 1;
+        } else {
+            queue->requests[queue->count].virt_addr = virt_addr;
+            queue->requests[queue->count].pages = pages;
+            queue->count++;
+        }
+        waits[i] = ++queue->queued;
+
+        /* Batch with the requests already waiting for an IPI */
+        int send_ipi = !queue->ipi_pending;
+        queue->ipi_pending = 1;
+
+        spinlock_release(&queue->lock);
+        interrupts_restore(rflags);
+
+        if (send_ipi) {
+            lapic_write(APICREG_ICR1, ((uint32_t)cpu_locals[i].lapic_id) << 24);
+            lapic_write(APICREG_ICR0, IPI_TLB);
+            spinlock_inc(&tlb_shootdowns_sent);
+        } else {
+            spinlock_inc(&tlb_shootdowns_avoided);
+        }
+    }
+
+    for (int i = 0; i < smp_cpu_count; i++) {
+        while (cpu_locals[i].tlb_queue.completed < waits[i]) {
+            /* Serve our own queue in case the target is waiting on us
+             * with interrupts disabled */
+            if (cpu_locals[self].tlb_queue.ipi_pending) {
+                uint64_t rflags = interrupts_save();
+                tlb_drain_queue();
+                interrupts_restore(rflags);
+            }
+            asm volatile ("pause");
+        }
+    }
+}
+
+/* Perform the invalidations queued for this CPU, if any. To be called by
+ * loops waiting on another CPU with interrupts disabled. */
+void tlb_serve_pending(void) {
+    if (cpu_locals_ready && cpu_locals[current_cpu].tlb_queue.ipi_pending)
+        tlb_drain_queue();
+}
+
+/* Acquire a lock with interrupts disabled. Whoever holds it may be waiting
+ * for this CPU to acknowledge a shootdown, so serve those while spinning. */
+void tlb_spinlock_acquire(lock_t *lock) {
+    while (!spinlock_test_and_acquire(lock)) {
+        tlb_serve_pending();
+        asm volatile ("pause");
+    }
+}
+
+/* Invalidate a range of `pagemap` after its page tables changed. The
+ * pagemap lock must be held. */
+void tlb_invalidate(struct pagemap_t *pagemap, size_t virt_addr, size_t pages) {
+    if (virt_addr < MEM_PHYS_OFFSET) {
+        /* CPUs which have the pagemap cached under a PCID, but not loaded,
+         * notice the new generation when they switch back to it */
+        size_t gen = tlb_new_generation();
+        pagemap->tlb_gen = gen;
+
+        uint64_t rflags = interrupts_save();
+        if (is_active_mapping(pagemap, virt_addr)) {
+            tlb_flush_local(virt_addr, pages);
+            /* This CPU's entries for the pagemap are current again */
+            if (pcid_enabled && cpu_locals_ready) {
+                struct cpu_local_t *cpu_local = &cpu_locals[current_cpu];
+                size_t pcid = read_cr3() & 0xfff;
+                if (cpu_local->pcids[pcid].pagemap == pagemap)
+                    cpu_local->pcids[pcid].gen = gen;
+            }
+        }
+        interrupts_restore(rflags);
+    } else {
+        tlb_flush_local(virt_addr, pages);
+    }
+
+    tlb_shootdown(pagemap, virt_addr, pages);
+}
+
+/* Returns the value to load CR3 with to switch to `pagemap`. Without PCIDs
+ * this is a plain switch. Otherwise the pagemap is given one of this CPU's
+ * PCIDs, and its TLB entries are kept unless the pagemap changed since.
+ * Interrupts should be OFF */
+size_t tlb_switch_cr3(struct pagemap_t *pagemap) {
+    struct cpu_local_t *cpu_local = &cpu_locals[current_cpu];
+    size_t cr3 = (size_t)pagemap->pml4 - MEM_PHYS_OFFSET;
+
+    cpu_local->active_pagemap = pagemap;
+
+    if (!pcid_enabled)
+        return cr3;
+
+    /* Publish active_pagemap before reading the generation, so that
+     * tlb_invalidate() either sees this CPU or bumps it first */
+    asm volatile ("mfence" ::: "memory");
+    size_t gen = pagemap->tlb_gen;
+
+    size_t pcid;
+    for (pcid = 0; pcid < TLB_PCID_COUNT; pcid++) {
+        if (cpu_local->pcids[pcid].pagemap == pagemap)
+            goto found;
+    }
+
+    /* Recycle a PCID, loading it without the no-flush bit drops its entries */
+    pcid = cpu_local->pcid_next;
+    cpu_local->pcid_next = (pcid + 1) % TLB_PCID_COUNT;
+    cpu_local->pcids[pcid].pagemap = pagemap;
+    cpu_local->pcids[pcid].gen = gen;
+    return cr3 | pcid;
+
+found:
+    if (cpu_local->pcids[pcid].gen == gen)
+        return cr3 | pcid | CR3_NOFLUSH;
+
+    cpu_local->pcids[pcid].gen = gen;
+    return cr3 | pcid;
+}
+
+void tlb_report(void) {
+    kprint(KPRN_INFO, "tlb: %U shootdown IPIs sent, %U avoided",
+           (size_t)spinlock_read(&tlb_shootdowns_sent),
+           (size_t)spinlock_read(&tlb_shootdowns_avoided));
+}
+
+/* Detect global page and PCID support. Called before any mapping is made. */
+void init_tlb(void) {
+    unsigned int eax, ebx, ecx = 0, edx = 0;
+
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    if (edx & (1 << 13)) {
+        pge_enabled = 1;
+        tlb_global_flag = (pt_entry_t)1 << 8;
+    }
+
+    /* Higher half entries have to be global for invlpg to reach them in
+     * every PCID, so PCIDs are only used along with global pages */
+    if (pge_enabled && (ecx & (1 << 17)))
+        pcid_enabled = 1;
+
+    kprint(KPRN_INFO, "tlb: Global pages %s, PCIDs %s",
+           pge_enabled ? "enabled" : "unsupported",
+           pcid_enabled ? "enabled" : "unsupported");
+}
+
+/* Enable the features on the calling CPU, with the kernel pagemap loaded */
+void init_tlb_cpu(void) {
+    size_t cr4 = read_cr4();
+
+    if (pge_enabled)
+        cr4 |= CR4_PGE;
+    if (pcid_enabled)
+        cr4 |= CR4_PCIDE;
+
+    load_cr4(cr4);
+}
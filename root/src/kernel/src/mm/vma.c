@@ -0,0 +1,706 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <mm.h>
+#include <vma.h>
+#include <tlb.h>
+#include <klib.h>
+#include <lock.h>
+#include <slab.h>
+#include <panic.h>
+#include <bench.h>
+
+static struct slab_cache_t *vma_cache;
+
+#define page_round_up(LEN) (((LEN) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+/* Page table flags for the pages of an area. The pages of a PROT_NONE area
+ * stay present but supervisor only, so that user accesses fault while they
+ * can still be freed by vma_unmap(). */
+static size_t prot_to_flags(int prot) {
+    size_t flags = 0x01;
+
+    if (prot != PROT_NONE)
+        flags |= 0x04;
+    if (prot & PROT_WRITE)
+        flags |= 0x02;
+
+    return flags;
+}
+
+/* AVL tree helpers, each returning the new root of the subtree */
+
+static int height(struct vma_t *node) {
+    return node ? node->height : 0;
+}
+
+static void update_height(struct vma_t *node) {
+    int left = height(node->left);
+    int right = height(node->right);
+
+    node->height = (left > right ? left : right) + 1;
+}
+
+static struct vma_t *rotate_right(struct vma_t *node) {
+    struct vma_t *left = node->left;
+
+    node->left = left->right;
+    left->right = node;
+    update_height(node);
+    update_height(left);
+
+    return left;
+}
+
+static struct vma_t *rotate_left(struct vma_t *node) {
+    struct vma_t *right = node->right;
+
+    node->right = right->left;
+    right->left = node;
+    update_height(node);
+    update_height(right);
+
+    return right;
+}
+
+static struct vma_t *rebalance(struct vma_t *node) {
+    update_height(node);
+
+    int balance = height(node->left) - height(node->right);
+
+    if (balance > 1) {
+        if (height(node->left->left) < height(node->left->right))
+            node->left = rotate_left(node->left);
+        return rotate_right(node);
+    }
+
+    if (balance < -1) {
+        if (height(node->right->right) < height(node->right->left))
+            node->right = rotate_right(node->right);
+        return rotate_left(node);
+    }
+
+    return node;
+}
+
+static struct vma_t *tree_insert(struct vma_t *root, struct vma_t *vma) {
+    if (!root) {
+        vma->left = (void *)0;
+        vma->right = (void *)0;
+        vma->height = 1;
+        return vma;
+    }
+
+    if (vma->base < root->base)
+        root->left = tree_insert(root->left, vma);
+    else
+        root->right = tree_insert(root->right, vma);
+
+    return rebalance(root);
+}
+
+static struct vma_t *tree_remove_min(struct vma_t *root, struct vma_t **min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = tree_remove_min(root->left, min);
+
+    return rebalance(root);
+}
+
+static struct vma_t *tree_remove(struct vma_t *root, size_t base) {
+    if (!root)
+        return (void *)0;
+
+    if (base < root->base) {
+        root->left = tree_remove(root->left, base);
+    } else if (base > root->base) {
+        root->right = tree_remove(root->right, base);
+    } else {
+        struct vma_t *left = root->left;
+        struct vma_t *right = root->right;
+        struct vma_t *min;
+
+        if (!right)
+            return left;
+
+        right = tree_remove_min(right, &min);
+        min->left = left;
+        min->right = right;
+        return rebalance(min);
+    }
+
+    return rebalance(root);
+}
+
+/* The area containing addr, or NULL */
+static struct vma_t *find_vma(struct vma_t *node, size_t addr) {
+    while (node) {
+        if (addr < node->base)
+            node = node->left;
+        else if (addr >= node->end)
+            node = node->right;
+        else
+            return node;
+    }
+
+    return (void *)0;
+}
+
+/* The lowest area ending above addr, or NULL. Since the areas do not
+ * overlap, they are sorted by end address as well. */
+static struct vma_t *next_vma(struct vma_t *node, size_t addr) {
+    struct vma_t *next = (void *)0;
+
+    while (node) {
+        if (node->end > addr) {
+            next = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+
+    return next;
+}
+
+static int range_is_free(struct pagemap_t *pagemap, size_t base, size_t end) {
+    struct vma_t *next = next_vma(pagemap->vmas, base);
+
+    return !next || next->base >= end;
+}
+
+/* Lowest free range of `len` bytes starting at or above `from`, or 0.
+ * Ranges which can hold a large page are aligned for one. */
+static size_t find_gap(struct pagemap_t *pagemap, size_t from, size_t len) {
+    size_t align = len >= LARGE_PAGE_SIZE ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    size_t base = from;
+
+    for (;;) {
+        base = (base + align - 1) & ~(align - 1);
+        if (base + len > USER_SPACE_TOP || base + len < base)
+            return 0;
+
+        struct vma_t *next = next_vma(pagemap->vmas, base);
+        if (!next || next->base >= base + len)
+            return base;
+
+        base = next->end;
+    }
+}
+
+/* Shared areas and areas mapping files are kept apart */
+static int can_merge(struct vma_t *vma, int prot) {
+    return vma && !vma->flags && vma->prot == prot;
+}
+
+/* Add the free range [base, end) as an area, merging it with the areas
+ * right next to it if they have the same protection. The vma lock must
+ * be held. */
+/* Returns the area the range ended up in, NULL on failure */
+static struct vma_t *insert_range(struct pagemap_t *pagemap, size_t base, size_t end,
+                                  int prot, int flags) {
+    struct vma_t *prev = base ? find_vma(pagemap->vmas, base - 1) : (void *)0;
+    struct vma_t *next = find_vma(pagemap->vmas, end);
+
+    if (!flags && can_merge(prev, prot)) {
+        prev->end = end;
+        if (can_merge(next, prot)) {
+            prev->end = next->end;
+            pagemap->vmas = tree_remove(pagemap->vmas, next->base);
+            slab_free(next);
+        }
+        return prev;
+    }
+
+    /* Moving the base down keeps the tree sorted, as the range was free */
+    if (!flags && can_merge(next, prot)) {
+        next->base = base;
+        return next;
+    }
+
+    struct vma_t *vma = slab_alloc(vma_cache);
+    if (!vma)
+        return (void *)0;
+
+    vma->base = base;
+    vma->end = end;
+    vma->prot = prot;
+    vma->flags = flags;
+    pagemap->vmas = tree_insert(pagemap->vmas, vma);
+
+    return vma;
+}
+
+/* Make sure no area straddles addr. The vma lock must be held. */
+static int split_vma(struct pagemap_t *pagemap, size_t addr) {
+    struct vma_t *vma = find_vma(pagemap->vmas, addr);
+    if (!vma || vma->base == addr)
+        return 0;
+
+    struct vma_t *upper = slab_alloc(vma_cache);
+    if (!upper)
+        return -1;
+
+    upper->base = addr;
+    upper->end = vma->end;
+    upper->prot = vma->prot;
+    upper->flags = vma->flags;
+    upper->file = vma->file;
+    upper->offset = vma->offset + (addr - vma->base);
+    upper->file_end = vma->file_end;
+    vma->end = addr;
+    pagemap->vmas = tree_insert(pagemap->vmas, upper);
+
+    return 0;
+}
+
+/* Make [base, base + len) an area of the pagemap. The range has to be page
+ * aligned and free. Nothing is mapped until the pages are touched. */
+/* Returns 0 on success, -1 on failure */
+int vma_map(struct pagemap_t *pagemap, size_t base, size_t len, int prot) {
+    int ret = -1;
+
+    if ((base & (PAGE_SIZE - 1)) || !len)
+        return -1;
+
+    size_t end = base + page_round_up(len);
+    if (end > USER_SPACE_TOP || end < base)
+        return -1;
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->vma_lock);
+
+    if (range_is_free(pagemap, base, end) && insert_range(pagemap, base, end, prot, 0))
+        ret = 0;
+
+    spinlock_release(&pagemap->vma_lock);
+    interrupts_restore(rflags);
+
+    return ret;
+}
+
+/* Like vma_map(), but the area is placed at the first free range at or
+ * above `hint`, or above MMAP_BASE if there is none. */
+/* Returns the base of the area, 0 on failure */
+size_t vma_map_anywhere(struct pagemap_t *pagemap, size_t hint, size_t len, int prot) {
+    if (!len)
+        return 0;
+
+    len = page_round_up(len);
+    hint &= ~(PAGE_SIZE - 1);
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->vma_lock);
+
+    size_t base = 0;
+    if (hint)
+        base = find_gap(pagemap, hint, len);
+    if (!base)
+        base = find_gap(pagemap, MMAP_BASE, len);
+
+    if (base && !insert_range(pagemap, base, base + len, prot, 0))
+        base = 0;
+
+    spinlock_release(&pagemap->vma_lock);
+    interrupts_restore(rflags);
+
+    return base;
+}
+
+/* Make [base, base + len) an area mapping the file from `offset` on, like
+ * vma_map() does. The pages of the file the area covers are read into the
+ * file cache here, as the page fault handler cannot do I/O, and mapped from
+ * it copy-on-write when first touched, so that processes mapping the same
+ * file share them until they write to them. The contents of the file end
+ * at `file_end`, the area is zeroed past that. */
+/* Returns 0 on success, -1 on failure */
+int vma_map_file(struct pagemap_t *pagemap, size_t base, size_t len, int prot,
+                 struct filemap_t *file, size_t offset, size_t file_end) {
+    int ret = -1;
+
+    if ((base & (PAGE_SIZE - 1)) || (offset & (PAGE_SIZE - 1)) || !len)
+        return -1;
+
+    size_t end = base + page_round_up(len);
+    if (end > USER_SPACE_TOP || end < base)
+        return -1;
+
+    for (size_t addr = base; addr < end && addr < file_end; addr += PAGE_SIZE) {
+        if (!filemap_page(file, (offset + addr - base) / PAGE_SIZE))
+            return -1;
+    }
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->vma_lock);
+
+    struct vma_t *vma;
+    if (range_is_free(pagemap, base, end)
+     && (vma = insert_range(pagemap, base, end, prot, VMA_FILE))) {
+        vma->file = file;
+        vma->offset = offset;
+        vma->file_end = file_end;
+        ret = 0;
+    }
+
+    spinlock_release(&pagemap->vma_lock);
+    interrupts_restore(rflags);
+
+    return ret;
+}
+
+/* Map the `pages` pages listed in `frames` as a shared area, placed like
+ * vma_map_anywhere() does. Each mapping holds a reference to its page, so
+ * the pages outlive whoever allocated them for as long as they are mapped. */
+/* Returns the base of the area, 0 on failure */
+size_t vma_map_shared(struct pagemap_t *pagemap, size_t hint, size_t *frames,
+                      size_t pages, int prot) {
+    size_t len = pages * PAGE_SIZE;
+    size_t i;
+
+    if (!pages)
+        return 0;
+
+    hint &= ~(PAGE_SIZE - 1);
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->vma_lock);
+
+    size_t base = 0;
+    if (hint)
+        base = find_gap(pagemap, hint, len);
+    if (!base)
+        base = find_gap(pagemap, MMAP_BASE, len);
+
+    if (!base || !insert_range(pagemap, base, base + len, prot, VMA_SHARED)) {
+        spinlock_release(&pagemap->vma_lock);
+        interrupts_restore(rflags);
+        return 0;
+    }
+
+    for (i = 0; i < pages; i++) {
+        pmm_ref((void *)frames[i]);
+        if (map_page(pagemap, frames[i], base + i * PAGE_SIZE, prot_to_flags(prot))) {
+            pmm_unref((void *)frames[i]);
+            break;
+        }
+    }
+
+    if (i < pages) {
+        /* Drops the references of the pages mapped so far */
+        pagemap->vmas = tree_remove(pagemap->vmas, base);
+        release_range(pagemap, base, i);
+        base = 0;
+    }
+
+    spinlock_release(&pagemap->vma_lock);
+    interrupts_restore(rflags);
+
+    return base;
+}
+
+/* Remove the areas in [base, base + len), freeing the pages which were
+ * backed. Parts of the range with no area are skipped. */
+/* Returns 0 on success, -1 on failure */
+int vma_unmap(struct pagemap_t *pagemap, size_t base, size_t len) {
+    if ((base & (PAGE_SIZE - 1)) || !len)
+        return -1;
+
+    size_t end = base + page_round_up(len);
+    if (end > USER_SPACE_TOP || end < base)
+        return -1;
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->vma_lock);
+
+    if (split_vma(pagemap, base) || split_vma(pagemap, end)) {
+        spinlock_release(&pagemap->vma_lock);
+        interrupts_restore(rflags);
+        return -1;
+    }
+
+    struct vma_t *vma;
+    while ((vma = next_vma(pagemap->vmas, base)) && vma->base < end) {
+        pagemap->vmas = tree_remove(pagemap->vmas, vma->base);
+        release_range(pagemap, vma->base, (vma->end - vma->base) / PAGE_SIZE);
+        slab_free(vma);
+    }
+
+    spinlock_release(&pagemap->vma_lock);
+    interrupts_restore(rflags);
+
+    return 0;
+}
+
+/* Change the protection of [base, base + len), which has to be covered by
+ * areas entirely */
+/* Returns 0 on success, -1 on failure */
+int vma_protect(struct pagemap_t *pagemap, size_t base, size_t len, int prot) {
+    if ((base & (PAGE_SIZE - 1)) || !len)
+        return -1;
+
+    size_t end = base + page_round_up(len);
+    if (end > USER_SPACE_TOP || end < base)
+        return -1;
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->vma_lock);
+
+    struct vma_t *vma;
+    for (size_t addr = base; addr < end; addr = vma->end) {
+        if (!(vma = find_vma(pagemap->vmas, addr)))
+            goto fail;
+    }
+
+    if (split_vma(pagemap, base) || split_vma(pagemap, end))
+        goto fail;
+
+    for (size_t addr = base; addr < end; addr = vma->end) {
+        vma = find_vma(pagemap->vmas, addr);
+        vma->prot = prot;
+        /* Pages not backed yet get the new flags when first touched */
+        protect_range(pagemap, vma->base, (vma->end - vma->base) / PAGE_SIZE,
+                      prot_to_flags(prot));
+    }
+
+    spinlock_release(&pagemap->vma_lock);
+    interrupts_restore(rflags);
+    return 0;
+
+fail:
+    spinlock_release(&pagemap->vma_lock);
+    interrupts_restore(rflags);
+    return -1;
+}
+
+/* Back a page of an area mapping a file with the file's page from the cache,
+ * where vma_map_file() put it.
+ * The page the contents of the file end in gets a copy with the rest of it
+ * zeroed instead, past it the pages are zeroed ones. */
+static int fault_file_page(struct pagemap_t *pagemap, struct vma_t *vma, size_t page_addr) {
+    size_t flags = prot_to_flags(vma->prot);
+
+    if (page_addr >= vma->file_end)
+        return vmm_back_page(pagemap, page_addr, flags);
+
+    void *page = filemap_lookup(vma->file, (vma->offset + page_addr - vma->base) / PAGE_SIZE);
+    if (!page)
+        return -1;
+
+    if (page_addr + PAGE_SIZE > vma->file_end)
+        return vmm_back_page_copy(pagemap, page_addr, flags,
+                                  (void *)((size_t)page + MEM_PHYS_OFFSET),
+                                  vma->file_end - page_addr);
+
+    return vmm_map_cow_page(pagemap, page_addr, (size_t)page, flags);
+}
+
+/* Resolve a page fault on the lower half, if it is on an area which allows
+ * the access: pages not backed yet are backed, from the file the area maps
+ * if there is one, and writes to pages shared copy-on-write get a copy.
+ * Called by the page fault handler, with interrupts disabled. Returns 0 if
+ * the fault was resolved. */
+int vma_handle_fault(struct pagemap_t *pagemap, size_t addr, size_t error_code) {
+    int ret = -1;
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->vma_lock);
+
+    struct vma_t *vma = find_vma(pagemap->vmas, addr);
+    if (!vma || vma->prot == PROT_NONE)
+        goto out;
+    /* The pages of shared areas are all mapped already */
+    if (vma->flags & VMA_SHARED)
+        goto out;
+    if ((error_code & 0x2) && !(vma->prot & PROT_WRITE))
+        goto out;
+
+    /* Any other fault on a present page is a protection violation */
+    if (error_code & 0x1) {
+        if (error_code & 0x2)
+            ret = vmm_break_cow(pagemap, addr, prot_to_flags(vma->prot));
+        goto out;
+    }
+
+    if (vma->file) {
+        ret = fault_file_page(pagemap, vma, addr & ~(PAGE_SIZE - 1));
+        goto out;
+    }
+
+    /* Back whole 2 MiB blocks of an area with large pages, when there is
+     * contiguous memory for them */
+    size_t large_base = addr & ~(LARGE_PAGE_SIZE - 1);
+    if (large_base >= vma->base && large_base + LARGE_PAGE_SIZE <= vma->end
+     && !vmm_back_large_page(pagemap, large_base, prot_to_flags(vma->prot))) {
+        ret = 0;
+        goto out;
+    }
+
+    ret = vmm_back_page(pagemap, addr & ~(PAGE_SIZE - 1), prot_to_flags(vma->prot));
+
+out:
+    spinlock_release(&pagemap->vma_lock);
+    interrupts_restore(rflags);
+    return ret;
+}
+
+static int fork_tree(struct pagemap_t *dst, struct pagemap_t *src,
+                     struct vma_t *node, struct vma_t **copy_out) {
+    *copy_out = (void *)0;
+
+    if (!node)
+        return 0;
+
+    struct vma_t *copy = slab_alloc(vma_cache);
+    if (!copy)
+        return -1;
+
+    *copy = *node;
+    copy->left = (void *)0;
+    copy->right = (void *)0;
+    *copy_out = copy;
+
+    if (vmm_share_range(dst, src, node->base, (node->end - node->base) / PAGE_SIZE,
+                        !(node->flags & VMA_SHARED)))
+        return -1;
+    if (fork_tree(dst, src, node->left, &copy->left))
+        return -1;
+    return fork_tree(dst, src, node->right, &copy->right);
+}
+
+/* Give `dst`, a pagemap with no areas yet, a copy of the areas of `src`,
+ * sharing their pages copy-on-write, or outright for shared areas. On failure `dst` is left with part of
+ * them, to be removed with vma_unmap(). */
+/* Returns 0 on success, -1 on failure */
+int vma_fork(struct pagemap_t *dst, struct pagemap_t *src) {
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&src->vma_lock);
+
+    /* The tree is copied as it is, so it stays balanced */
+    int ret = fork_tree(dst, src, src->vmas, &dst->vmas);
+
+    spinlock_release(&src->vma_lock);
+    interrupts_restore(rflags);
+
+    return ret;
+}
+
+static void free_tree(struct vma_t *node) {
+    if (!node)
+        return;
+
+    free_tree(node->left);
+    free_tree(node->right);
+    slab_free(node);
+}
+
+/* Free a pagemap no CPU has loaded anymore, along with its areas and
+ * everything mapped in its lower half, see free_pagemap() */
+void vma_destroy(struct pagemap_t *pagemap) {
+    free_tree(pagemap->vmas);
+    pagemap->vmas = (void *)0;
+
+    free_pagemap(pagemap);
+}
+
+#define FORK_BENCH_ITERATIONS 16
+
+/* A pagemap with `pages` resident 4 KiB pages, or NULL */
+static struct pagemap_t *bench_pagemap(size_t pages) {
+    struct pagemap_t *pagemap = new_pagemap();
+    if (!pagemap)
+        return (void *)0;
+
+    if (vma_map(pagemap, MMAP_BASE, pages * PAGE_SIZE, PROT_READ | PROT_WRITE)) {
+        vma_destroy(pagemap);
+        return (void *)0;
+    }
+    for (size_t i = 0; i < pages; i++) {
+        if (vmm_back_page(pagemap, MMAP_BASE + i * PAGE_SIZE, prot_to_flags(PROT_READ | PROT_WRITE))) {
+            vma_destroy(pagemap);
+            return (void *)0;
+        }
+    }
+
+    return pagemap;
+}
+
+/* Time duplicating an address space with vma_fork() and tearing the copy
+ * down again, for parents with increasingly many resident pages. This is
+ * only the address space part of fork() followed by exit(): the syscall,
+ * creating the process and its thread, the copy-on-write faults taken
+ * afterwards and task_pexit() are not measured. */
+void vma_fork_bench(void) {
+    static const size_t resident_sizes[] = { 16, 256, 4096, 32768 };
+
+    for (size_t i = 0; i < sizeof(resident_sizes) / sizeof(size_t); i++) {
+        size_t pages = resident_sizes[i];
+
+        struct pagemap_t *parent = bench_pagemap(pages);
+        if (!parent) {
+            kprint(KPRN_WARN, "vma: bench: Out of memory backing %U pages", pages);
+            return;
+        }
+
+        uint64_t fork_cycles = 0, exit_cycles = 0;
+        for (size_t j = 0; j < FORK_BENCH_ITERATIONS; j++) {
+            uint64_t start = rdtsc();
+            struct pagemap_t *child = new_pagemap();
+            if (!child || vma_fork(child, parent)) {
+                kprint(KPRN_WARN, "vma: bench: Fork of %U pages failed", pages);
+                if (child)
+                    vma_destroy(child);
+                vma_destroy(parent);
+                return;
+            }
+            uint64_t forked = rdtsc();
+            vma_destroy(child);
+            exit_cycles += rdtsc() - forked;
+            fork_cycles += forked - start;
+        }
+
+        kprint(KPRN_INFO, "vma: bench: vmfork: %U resident pages: %U cycles to fork, %U cycles to exit",
+               pages, fork_cycles / FORK_BENCH_ITERATIONS, exit_cycles / FORK_BENCH_ITERATIONS);
+
+        vma_destroy(parent);
+    }
+}
+
+/* Time tearing down address spaces of increasing size with vma_destroy(),
+ * against unmapping the whole lower half area by area first, which flushes
+ * and frees pages and tables one at a time. */
+void vma_teardown_bench(void) {
+    static const size_t resident_sizes[] = { 256, 4096, 32768, 131072 };
+
+    for (size_t i = 0; i < sizeof(resident_sizes) / sizeof(size_t); i++) {
+        size_t pages = resident_sizes[i];
+
+        struct pagemap_t *pagemap = bench_pagemap(pages);
+        if (!pagemap) {
+            kprint(KPRN_WARN, "vma: bench: Out of memory backing %U pages", pages);
+            return;
+        }
+        uint64_t start = rdtsc();
+        vma_unmap(pagemap, 0, USER_SPACE_TOP);
+        vma_destroy(pagemap);
+        uint64_t unmap_cycles = rdtsc() - start;
+
+        if (!(pagemap = bench_pagemap(pages))) {
+            kprint(KPRN_WARN, "vma: bench: Out of memory backing %U pages", pages);
+            return;
+        }
+        start = rdtsc();
+        vma_destroy(pagemap);
+        uint64_t destroy_cycles = rdtsc() - start;
+
+        kprint(KPRN_INFO, "vma: bench: teardown: %U resident pages: %U cycles unmapping, %U cycles destroying",
+               pages, unmap_cycles, destroy_cycles);
+    }
+}
+
+void init_vma(void) {
+    vma_cache = slab_cache_create("vma", sizeof(struct vma_t));
+    if (!vma_cache)
+        panic("vma: Unable to create the area cache", 0, 0);
+}
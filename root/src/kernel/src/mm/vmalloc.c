@@ -0,0 +1,309 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <mm.h>
+#include <klib.h>
+#include <lock.h>
+#include <slab.h>
+#include <panic.h>
+#include <tlb.h>
+
+/* Virtually contiguous kernel allocations, backed by whatever physical
+ * pages are free. The region is a single PML4 entry, whose PDPT is set up
+ * before any process exists so that every process shares it. */
+#define VMALLOC_BASE ((size_t)0xffffc00000000000)
+#define VMALLOC_SIZE ((size_t)0x8000000000)
+
+/* Every area reserves twice what it maps (and at least this many pages)
+ * so that it can grow in place, and areas are kept one guard page apart */
+#define VMALLOC_MIN_RESERVE 16
+
+struct vmalloc_area_t {
+    size_t base;
+    /* Bytes requested */
+    size_t size;
+    /* Pages mapped */
+    size_t pages;
+    /* Pages of virtual address space reserved */
+    size_t reserved;
+    struct vmalloc_area_t *next;
+};
+
+/* Held with interrupts disabled, as it is needed by kalloc() wherever that
+ * is called from. A CPU spinning on it serves TLB shootdowns, since the
+ * holder may be waiting on one when unmapping. */
+static lock_t vmalloc_lock = 1;
+
+/* Sorted by base address */
+static struct vmalloc_area_t *areas = (void *)0;
+static struct slab_cache_t *area_cache;
+
+static size_t vmalloc_reserve(size_t pages) {
+    size_t reserved = pages * 2;
+
+    if (reserved < VMALLOC_MIN_RESERVE)
+        reserved = VMALLOC_MIN_RESERVE;
+
+    return reserved;
+}
+
+/* Find the lowest base where `reserved` pages fit. vmalloc_lock must be held. */
+static size_t find_gap(size_t reserved, struct vmalloc_area_t **prev_out) {
+    struct vmalloc_area_t *prev = (void *)0;
+    size_t base = VMALLOC_BASE;
+
+    for (struct vmalloc_area_t *area = areas; area; area = area->next) {
+        if (base + (reserved + 1) * PAGE_SIZE <= area->base)
+            break;
+        base = area->base + (area->reserved + 1) * PAGE_SIZE;
+        prev = area;
+    }
+
+    if (base + reserved * PAGE_SIZE > VMALLOC_BASE + VMALLOC_SIZE)
+        return 0;
+
+    *prev_out = prev;
+    return base;
+}
+
+static void insert_area(struct vmalloc_area_t *prev, struct vmalloc_area_t *area) {
+    if (prev) {
+        area->next = prev->next;
+        prev->next = area;
+    } else {
+        area->next = areas;
+        areas = area;
+    }
+}
+
+static struct vmalloc_area_t *find_area(size_t base, struct vmalloc_area_t **prev_out) {
+    struct vmalloc_area_t *prev = (void *)0;
+
+    for (struct vmalloc_area_t *area = areas; area; area = area->next) {
+        if (area->base == base) {
+            if (prev_out)
+                *prev_out = prev;
+            return area;
+        }
+        prev = area;
+    }
+
+    return (void *)0;
+}
+
+static void remove_area(struct vmalloc_area_t *prev, struct vmalloc_area_t *area) {
+    if (prev)
+        prev->next = area->next;
+    else
+        areas = area->next;
+}
+
+/* Map zeroed pages [from, to) of an area. The pages are taken as one
+ * physically contiguous run and mapped with a single map_range() if there
+ * is one, otherwise in smaller runs. Each page is freed on its own later.
+ * Returns -1 on failure, leaving the pages which could be mapped in place. */
+static int map_area_pages(struct vmalloc_area_t *area, size_t from, size_t to) {
+    size_t run = to - from;
+
+    for (size_t i = from; i < to; i += run) {
+        if (run > to - i)
+            run = to - i;
+
+        void *ptr;
+        while (!(ptr = pmm_alloc(run))) {
+            if (run == 1)
+                return -1;
+            run /= 2;
+        }
+
+        if (map_range(&kernel_pagemap, (size_t)ptr, area->base + i * PAGE_SIZE, run, 0x03)) {
+            /* The part of the run which was mapped is unmapped with the
+             * rest of the area, the part which was not is freed here */
+            for (size_t j = 0; j < run; j++) {
+                if (virt_to_phys(&kernel_pagemap, area->base + (i + j) * PAGE_SIZE)
+                    != (size_t)ptr + j * PAGE_SIZE)
+                    pmm_free((void *)((size_t)ptr + j * PAGE_SIZE), 1);
+            }
+            area->pages = i + run;
+            return -1;
+        }
+        area->pages = i + run;
+    }
+
+    return 0;
+}
+
+static void unmap_area_pages(struct vmalloc_area_t *area, size_t from) {
+    release_range(&kernel_pagemap, area->base + from * PAGE_SIZE, area->pages - from);
+    area->pages = from;
+}
+
+void *vmalloc(size_t size) {
+    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    struct vmalloc_area_t *area = slab_alloc(area_cache);
+    if (!area)
+        return (void *)0;
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&vmalloc_lock);
+
+    struct vmalloc_area_t *prev;
+    area->reserved = vmalloc_reserve(pages);
+    area->base = find_gap(area->reserved, &prev);
+    if (!area->base) {
+        spinlock_release(&vmalloc_lock);
+        interrupts_restore(rflags);
+        slab_free(area);
+        return (void *)0;
+    }
+    area->size = size;
+    area->pages = 0;
+    insert_area(prev, area);
+
+    if (map_area_pages(area, 0, pages) == -1) {
+        unmap_area_pages(area, 0);
+        remove_area(prev, area);
+        spinlock_release(&vmalloc_lock);
+        interrupts_restore(rflags);
+        slab_free(area);
+        return (void *)0;
+    }
+
+    spinlock_release(&vmalloc_lock);
+    interrupts_restore(rflags);
+
+    return (void *)area->base;
+}
+
+void vfree(void *ptr) {
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&vmalloc_lock);
+
+    struct vmalloc_area_t *prev;
+    struct vmalloc_area_t *area = find_area((size_t)ptr, &prev);
+    if (!area) {
+        spinlock_release(&vmalloc_lock);
+        interrupts_restore(rflags);
+        kprint(KPRN_WARN, "vmalloc: vfree() of unknown address %X", ptr);
+        return;
+    }
+
+    unmap_area_pages(area, 0);
+    remove_area(prev, area);
+
+    spinlock_release(&vmalloc_lock);
+    interrupts_restore(rflags);
+
+    slab_free(area);
+
+    return;
+}
+
+/* Grow or shrink an area. The data is never copied: the area is extended
+ * within its reservation or into the free space after it if possible,
+ * otherwise its pages are moved to a new range. */
+void *vrealloc(void *ptr, size_t size) {
+    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&vmalloc_lock);
+
+    struct vmalloc_area_t *prev;
+    struct vmalloc_area_t *area = find_area((size_t)ptr, &prev);
+    if (!area) {
+        spinlock_release(&vmalloc_lock);
+        interrupts_restore(rflags);
+        return (void *)0;
+    }
+
+    /* Bytes past the old size must read as zero, like a fresh allocation */
+    if (size > area->size) {
+        size_t end = MIN(size, area->pages * PAGE_SIZE);
+        if (end > area->size)
+            kmemset((char *)area->base + area->size, 0, end - area->size);
+    }
+
+    if (pages <= area->pages) {
+        area->size = size;
+        spinlock_release(&vmalloc_lock);
+        interrupts_restore(rflags);
+        return ptr;
+    }
+
+    if (pages > area->reserved) {
+        size_t reserved = vmalloc_reserve(pages);
+        size_t limit = area->next ? area->next->base - PAGE_SIZE
+                                  : VMALLOC_BASE + VMALLOC_SIZE;
+
+        if (area->base + reserved * PAGE_SIZE <= limit) {
+            area->reserved = reserved;
+        } else {
+            /* Move the mappings to a range that fits */
+            remove_area(prev, area);
+            size_t new_base = find_gap(reserved, &prev);
+            if (!new_base) {
+                insert_area(prev, area);
+                spinlock_release(&vmalloc_lock);
+                interrupts_restore(rflags);
+                return (void *)0;
+            }
+            /* A map_range() per physically contiguous run */
+            for (size_t i = 0, run; i < area->pages; i += run) {
+                size_t phys = virt_to_phys(&kernel_pagemap, area->base + i * PAGE_SIZE);
+                for (run = 1; i + run < area->pages; run++) {
+                    if (virt_to_phys(&kernel_pagemap, area->base + (i + run) * PAGE_SIZE)
+                        != phys + run * PAGE_SIZE)
+                        break;
+                }
+                map_range(&kernel_pagemap, phys, new_base + i * PAGE_SIZE, run, 0x03);
+            }
+            unmap_range(&kernel_pagemap, area->base, area->pages);
+            area->base = new_base;
+            area->reserved = reserved;
+            insert_area(prev, area);
+        }
+    }
+
+    if (map_area_pages(area, area->pages, pages) == -1) {
+        spinlock_release(&vmalloc_lock);
+        interrupts_restore(rflags);
+        return (void *)0;
+    }
+
+    area->size = size;
+
+    spinlock_release(&vmalloc_lock);
+    interrupts_restore(rflags);
+
+    return (void *)area->base;
+}
+
+size_t vmalloc_size(void *ptr) {
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&vmalloc_lock);
+
+    struct vmalloc_area_t *area = find_area((size_t)ptr, (void *)0);
+    size_t size = area ? area->size : 0;
+
+    spinlock_release(&vmalloc_lock);
+    interrupts_restore(rflags);
+
+    return size;
+}
+
+void init_vmalloc(void) {
+    area_cache = slab_cache_create("vmalloc_area", sizeof(struct vmalloc_area_t));
+    if (!area_cache)
+        panic("vmalloc: Unable to create the area cache", 0, 0);
+
+    /* Set up the PDPT now, so it is part of every process' higher half */
+    size_t pml4_entry = (VMALLOC_BASE >> 39) & 0x1ff;
+    void *pdpt = pmm_alloc(1);
+    if (!pdpt)
+        panic("vmalloc: Unable to allocate the PDPT", 0, 0);
+    kernel_pagemap.pml4[pml4_entry] = (pt_entry_t)pdpt | 0x03;
+
+    kprint(KPRN_INFO, "vmalloc: %U GiB area at %X", VMALLOC_SIZE / 0x40000000, VMALLOC_BASE);
+
+    return;
+}
@@ -1,198 +1,914 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <cpuid.h>
 #include <mm.h>
 #include <klib.h>
 #include <e820.h>
 #include <lock.h>
 #include <panic.h>
+#include <tlb.h>
+
+#define HUGE_PAGE_SIZE ((size_t)0x40000000)
+
+/* Page size bit in a pdpt or pd entry */
+#define PAGE_PS ((pt_entry_t)1 << 7)
+/* PAT bit, in a pt entry and in a large page entry respectively */
+#define PAGE_PAT ((pt_entry_t)1 << 7)
+#define LARGE_PAGE_PAT ((pt_entry_t)1 << 12)
+
+#define PAGE_ADDR_MASK ((pt_entry_t)0x000ffffffffff000)
+
+#define PAGE_ACCESSED ((pt_entry_t)1 << 5)
+#define PAGE_DIRTY ((pt_entry_t)1 << 6)
+#define PAGE_NX ((pt_entry_t)1 << 63)
+
+/* Set on pages shared copy-on-write, which are mapped read-only whatever
+ * the flags they were given. A write fault on such a page gives the
+ * pagemap a private copy of it. */
+#define PAGE_COW ((pt_entry_t)1 << 9)
 
 struct pagemap_t kernel_pagemap;
 
-/* map physaddr -> virtaddr using pml4 pointer */
-/* Returns 0 on success, -1 on failure */
-int map_page(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr, size_t flags) {
-    spinlock_acquire(&pagemap->lock);
+/* Whether the CPU supports 1 GiB pages */
+static int huge_pages = 0;
+
+/* Zeroed pages kept aside for page tables, so that mapping a range rarely
+ * needs to call into the PMM with a pagemap lock held. Like the pagemap
+ * locks, the lock is only held with interrupts disabled. */
+#define PT_RESERVE_SIZE 32
+
+static lock_t pt_reserve_lock = 1;
+static size_t pt_reserve[PT_RESERVE_SIZE];
+static size_t pt_reserve_count = 0;
+
+/* Top up the reserve. Called without any pagemap lock held. */
+static void pt_reserve_fill(void) {
+    uint64_t rflags = interrupts_save();
+    spinlock_acquire(&pt_reserve_lock);
+    while (pt_reserve_count < PT_RESERVE_SIZE) {
+        void *ptr = pmm_alloc(1);
+        if (!ptr)
+            break;
+        pt_reserve[pt_reserve_count++] = (size_t)ptr;
+    }
+    spinlock_release(&pt_reserve_lock);
+    interrupts_restore(rflags);
+}
+
+/* Returns the virtual address of a zeroed page table, or NULL */
+static pt_entry_t *pt_alloc(void) {
+    size_t ptr = 0;
+
+    uint64_t rflags = interrupts_save();
+    spinlock_acquire(&pt_reserve_lock);
+    if (pt_reserve_count)
+        ptr = pt_reserve[--pt_reserve_count];
+    spinlock_release(&pt_reserve_lock);
+    interrupts_restore(rflags);
+
+    if (!ptr)
+        ptr = (size_t)pmm_alloc(1);
+    if (!ptr)
+        return (void *)0;
+
+    return (pt_entry_t *)(ptr + MEM_PHYS_OFFSET);
+}
+
+/* Release a table which no longer has any present entries. The TLB must not
+ * reference it anymore. */
+static void pt_free(pt_entry_t *table) {
+    kmemset(table, 0, PAGE_SIZE);
+
+    uint64_t rflags = interrupts_save();
+    spinlock_acquire(&pt_reserve_lock);
+    if (pt_reserve_count < PT_RESERVE_SIZE) {
+        pt_reserve[pt_reserve_count++] = (size_t)table - MEM_PHYS_OFFSET;
+        spinlock_release(&pt_reserve_lock);
+        interrupts_restore(rflags);
+        return;
+    }
+    spinlock_release(&pt_reserve_lock);
+    interrupts_restore(rflags);
+
+    pmm_free((void *)((size_t)table - MEM_PHYS_OFFSET), 1);
+}
+
+/* Replace a large page mapping of `page_size` bytes with a table mapping the
+ * same memory with pages of the next size down. Returns -1 on failure. */
+static int split_large_page(pt_entry_t *entry, size_t page_size) {
+    pt_entry_t *table = pt_alloc();
+    if (!table)
+        return -1;
+
+    size_t sub_size = page_size / PAGE_TABLE_ENTRIES;
+    size_t phys_addr = *entry & PAGE_ADDR_MASK & ~(page_size - 1);
+    pt_entry_t flags = *entry & ~PAGE_ADDR_MASK;
+
+    /* 4 KiB pages keep the PAT bit where the page size bit was */
+    if (sub_size == PAGE_SIZE) {
+        flags &= ~PAGE_PS;
+        if (*entry & LARGE_PAGE_PAT)
+            flags |= PAGE_PAT;
+    } else {
+        flags |= *entry & LARGE_PAGE_PAT;
+    }
+
+    for (size_t i = 0; i < PAGE_TABLE_ENTRIES; i++)
+        table[i] = (pt_entry_t)(phys_addr + i * sub_size) | flags;
+
+    /* Present + writable + user (0b111) */
+    *entry = (pt_entry_t)((size_t)table - MEM_PHYS_OFFSET) | 0b111;
+
+    return 0;
+}
+
+/* Return the table referenced by `entry` of `table`. Each entry of `table`
+ * maps `page_size` bytes, or 0 if it cannot be a large page. Large pages are
+ * split, and if `alloc` is set, missing tables are allocated.
+ * Returns NULL if there is no table. */
+static pt_entry_t *next_level(pt_entry_t *table, size_t entry, size_t page_size, int alloc) {
+    if (table[entry] & 0x1) {
+        if (page_size && (table[entry] & PAGE_PS)) {
+            if (split_large_page(&table[entry], page_size))
+                return (void *)0;
+        }
+        return (pt_entry_t *)((table[entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+    }
+
+    if (!alloc)
+        return (void *)0;
 
+    pt_entry_t *next = pt_alloc();
+    /* Catch allocation failure */
+    if (!next)
+        return (void *)0;
+    /* Present + writable + user (0b111) */
+    table[entry] = (pt_entry_t)((size_t)next - MEM_PHYS_OFFSET) | 0b111;
+
+    return next;
+}
+
+/* Get the page table covering virt_addr, allocating the missing levels if
+ * `alloc` is set and splitting any large page in the way. The pagemap lock
+ * must be held. Returns NULL if there is no table. */
+static pt_entry_t *get_pt(struct pagemap_t *pagemap, size_t virt_addr, int alloc) {
     /* Calculate the indices in the various tables using the virtual address */
     size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
     size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
     size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
-    size_t pt_entry = (virt_addr & ((size_t)0x1ff << 12)) >> 12;
 
-    pt_entry_t *pdpt, *pd, *pt;
+    pt_entry_t *pdpt, *pd;
 
-    /* Check present flag */
-    if (pagemap->pml4[pml4_entry] & 0x1) {
-        /* Reference pdpt */
-        pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        /* Allocate a page for the pdpt. */
-        pdpt = (pt_entry_t *)((size_t)pmm_alloc(1) + MEM_PHYS_OFFSET);
-        /* Catch allocation failure */
-        if ((size_t)pdpt == MEM_PHYS_OFFSET)
-            goto fail1;
-        /* Present + writable + user (0b111) */
-        pagemap->pml4[pml4_entry] = (pt_entry_t)((size_t)pdpt - MEM_PHYS_OFFSET) | 0b111;
-    }
-
-    /* Rinse and repeat */
-    if (pdpt[pdpt_entry] & 0x1) {
-        pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        /* Allocate a page for the pd. */
-        pd = (pt_entry_t *)((size_t)pmm_alloc(1) + MEM_PHYS_OFFSET);
-        /* Catch allocation failure */
-        if ((size_t)pdpt == MEM_PHYS_OFFSET)
-            goto fail2;
-        /* Present + writable + user (0b111) */
-        pdpt[pdpt_entry] = (pt_entry_t)((size_t)pd - MEM_PHYS_OFFSET) | 0b111;
-    }
-
-    /* Once more */
-    if (pd[pd_entry] & 0x1) {
-        pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        /* Allocate a page for the pt. */
-        pt = (pt_entry_t *)((size_t)pmm_alloc(1) + MEM_PHYS_OFFSET);
-        /* Catch allocation failure */
-        if ((size_t)pdpt == MEM_PHYS_OFFSET)
-            goto fail3;
-        /* Present + writable + user (0b111) */
-        pd[pd_entry] = (pt_entry_t)((size_t)pt - MEM_PHYS_OFFSET) | 0b111;
-    }
+    if (!(pdpt = next_level(pagemap->pml4, pml4_entry, 0, alloc)))
+        return (void *)0;
+    if (!(pd = next_level(pdpt, pdpt_entry, HUGE_PAGE_SIZE, alloc)))
+        return (void *)0;
+
+    return next_level(pd, pd_entry, LARGE_PAGE_SIZE, alloc);
+}
+
+/* Get the pd entry covering virt_addr, allocating the missing levels above
+ * it if `alloc` is set. Unlike get_pt(), a large page there is left as it
+ * is. The pagemap lock must be held. Returns NULL if there is no pd. */
+static pt_entry_t *get_pd_entry(struct pagemap_t *pagemap, size_t virt_addr, int alloc) {
+    size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
+    size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
+    size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
+
+    pt_entry_t *pdpt, *pd;
+
+    if (!(pdpt = next_level(pagemap->pml4, pml4_entry, 0, alloc)))
+        return (void *)0;
+    if (!(pd = next_level(pdpt, pdpt_entry, HUGE_PAGE_SIZE, alloc)))
+        return (void *)0;
 
-    /* Set the entry as present and point it to the passed physical address */
-    /* Also set the specified flags */
-    pt[pt_entry] = (pt_entry_t)(phys_addr | flags);
+    return &pd[pd_entry];
+}
+
+/* Invalidate the TLB entries for a range after its page tables changed */
+static void flush_range(struct pagemap_t *pagemap, size_t virt_addr, size_t pages) {
+    if (!pages)
+        return;
+
+    tlb_invalidate(pagemap, virt_addr, pages);
+}
+
+/* Map `pages` physically contiguous pages starting at phys_addr to virt_addr */
+/* Returns 0 on success, -1 on failure */
+int map_range(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr,
+              size_t pages, size_t flags) {
+    int ret = 0;
+    pt_entry_t *pt = (void *)0;
+    size_t i;
+    /* Entries which were not present cannot be in any TLB, only replacing
+     * a mapping needs a flush */
+    int replaced = 0;
+
+    virt_addr &= ~(PAGE_SIZE - 1);
+
+    /* The higher half is the same in every address space */
+    if (virt_addr >= MEM_PHYS_OFFSET)
+        flags |= tlb_global_flag;
+
+    pt_reserve_fill();
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->lock);
 
-    if ((size_t)pagemap->pml4 == read_cr3()) {
-        // TODO: TLB shootdown
-        invlpg(virt_addr);
+    for (i = 0; i < pages; i++) {
+        size_t virt = virt_addr + i * PAGE_SIZE;
+        size_t pt_entry = (virt & ((size_t)0x1ff << 12)) >> 12;
+
+        /* Only walk from the PML4 again when crossing into the next table */
+        if (!pt || !pt_entry) {
+            if (!(pt = get_pt(pagemap, virt, 1))) {
+                ret = -1;
+                break;
+            }
+        }
+
+        if (pt[pt_entry] & 0x1) {
+            pmm_mapcount_add(pt[pt_entry] & PAGE_ADDR_MASK, -1);
+            replaced = 1;
+        }
+
+        /* Set the entry as present and point it to the passed physical address */
+        /* Also set the specified flags */
+        pt[pt_entry] = (pt_entry_t)((phys_addr + i * PAGE_SIZE) | flags);
+        pmm_mapcount_add(phys_addr + i * PAGE_SIZE, 1);
     }
 
+    if (replaced)
+        flush_range(pagemap, virt_addr, i);
+
     spinlock_release(&pagemap->lock);
+    interrupts_restore(rflags);
+    return ret;
+}
+
+/* Drop a large page mapping's references to its pages. Returns 1 if no one
+ * else maps any of it, in which case the caller is to free the block whole.
+ * Otherwise the pages which lost their last reference are linked onto
+ * `page_list` through the physical memory map, for the caller to free one
+ * by one. */
+static int unref_large_page(size_t phys, size_t *page_list) {
+    size_t last_refs = 0;
+
+    for (size_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+        pmm_mapcount_add(phys + i * PAGE_SIZE, -1);
+        if (pmm_unref((void *)(phys + i * PAGE_SIZE)))
+            last_refs++;
+    }
+
+    if (last_refs == PAGE_TABLE_ENTRIES)
+        return 1;
+
+    for (size_t i = 0; last_refs && i < PAGE_TABLE_ENTRIES; i++) {
+        size_t page = phys + i * PAGE_SIZE;
+        if (!pmm_page(page)->refcount) {
+            *(size_t *)(page + MEM_PHYS_OFFSET) = *page_list;
+            *page_list = page;
+            last_refs--;
+        }
+    }
+
     return 0;
+}
 
-    /* Free previous levels if empty */
-fail3:
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pd - MEM_PHYS_OFFSET, 1);
-            break;
+/* Unmap `pages` pages starting at virt_addr. Page tables left empty are freed
+ * once the TLB no longer references them. The higher half PDPTs are copied
+ * into every process, so they are never freed. If `release` is set, the
+ * pages which were mapped are freed along with the tables. */
+/* Returns -1 if any of the pages was not mapped */
+static int do_unmap_range(struct pagemap_t *pagemap, size_t virt_addr, size_t pages, int release) {
+    int ret = 0;
+    pt_entry_t *pt = (void *)0;
+    /* Tables to free after the flush, linked through their first entry */
+    pt_entry_t *free_list = (void *)0;
+    /* Pages and large pages to free after the flush, linked through the
+     * physical memory map */
+    size_t page_list = 0;
+    size_t large_page_list = 0;
+
+    virt_addr &= ~(PAGE_SIZE - 1);
+
+    /* Large pages only partly unmapped have to be split */
+    pt_reserve_fill();
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->lock);
+
+    for (size_t i = 0; i < pages; i++) {
+        size_t virt = virt_addr + i * PAGE_SIZE;
+        size_t pt_entry = (virt & ((size_t)0x1ff << 12)) >> 12;
+
+        if (!pt || !pt_entry) {
+            /* Large pages unmapped as a whole are dropped without splitting */
+            pt_entry_t *pd_entry = get_pd_entry(pagemap, virt, 0);
+            if (pd_entry && (*pd_entry & PAGE_PS) && !pt_entry
+             && pages - i >= PAGE_TABLE_ENTRIES) {
+                size_t phys = *pd_entry & PAGE_ADDR_MASK & ~(LARGE_PAGE_SIZE - 1);
+                if (!release) {
+                    for (size_t j = 0; j < PAGE_TABLE_ENTRIES; j++)
+                        pmm_mapcount_add(phys + j * PAGE_SIZE, -1);
+                } else if (unref_large_page(phys, &page_list)) {
+                    *(size_t *)(phys + MEM_PHYS_OFFSET) = large_page_list;
+                    large_page_list = phys;
+                }
+                *pd_entry = 0;
+                pt = (void *)0;
+                i += PAGE_TABLE_ENTRIES - 1;
+                continue;
+            }
+            if (!(pt = get_pt(pagemap, virt, 0))) {
+                /* Skip the rest of the range the missing table would cover */
+                ret = -1;
+                i += PAGE_TABLE_ENTRIES - pt_entry - 1;
+                continue;
+            }
         }
-        if (pd[i] & 0x1) {
-            /* Table is not free */
-            goto fail1;
+
+        if (!pt[pt_entry]) {
+            ret = -1;
+            continue;
+        }
+
+        if (pt[pt_entry] & 0x1) {
+            size_t phys = pt[pt_entry] & PAGE_ADDR_MASK;
+            pmm_mapcount_add(phys, -1);
+            /* Shared pages are left to their other mappings */
+            if (release && pmm_unref((void *)phys)) {
+                *(size_t *)(phys + MEM_PHYS_OFFSET) = page_list;
+                page_list = phys;
+            }
         }
+
+        /* Unmap entry */
+        pt[pt_entry] = 0;
     }
 
-fail2:
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pdpt - MEM_PHYS_OFFSET, 1);
-            break;
+    /* Unlink the tables the range left empty, bottom-up */
+    size_t end = virt_addr + pages * PAGE_SIZE;
+    for (size_t virt = virt_addr & ~(LARGE_PAGE_SIZE - 1); virt < end; virt += LARGE_PAGE_SIZE) {
+        size_t pml4_entry = (virt & ((size_t)0x1ff << 39)) >> 39;
+        size_t pdpt_entry = (virt & ((size_t)0x1ff << 30)) >> 30;
+        size_t pd_entry = (virt & ((size_t)0x1ff << 21)) >> 21;
+
+        if (!(pagemap->pml4[pml4_entry] & 0x1))
+            continue;
+        pt_entry_t *pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+        if (!(pdpt[pdpt_entry] & 0x1) || (pdpt[pdpt_entry] & PAGE_PS))
+            continue;
+        pt_entry_t *pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+        if (pd[pd_entry] & PAGE_PS)
+            continue;
+
+        size_t j;
+        /* The entry may be gone already, if it was a large page */
+        if (pd[pd_entry] & 0x1) {
+            pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+            for (j = 0; j < PAGE_TABLE_ENTRIES && !pt[j]; j++);
+            if (j < PAGE_TABLE_ENTRIES)
+                continue;
+            pd[pd_entry] = 0;
+            pt[0] = (pt_entry_t)free_list;
+            free_list = pt;
         }
-        if (pdpt[i] & 0x1) {
-            /* Table is not free */
-            goto fail1;
+
+        for (j = 0; j < PAGE_TABLE_ENTRIES && !(pd[j] & 0x1); j++);
+        if (j < PAGE_TABLE_ENTRIES)
+            continue;
+        pdpt[pdpt_entry] = 0;
+        pd[0] = (pt_entry_t)free_list;
+        free_list = pd;
+
+        if (pml4_entry >= 256)
+            continue;
+        for (j = 0; j < PAGE_TABLE_ENTRIES && !(pdpt[j] & 0x1); j++);
+        if (j < PAGE_TABLE_ENTRIES)
+            continue;
+        pagemap->pml4[pml4_entry] = 0;
+        pdpt[0] = (pt_entry_t)free_list;
+        free_list = pdpt;
+    }
+
+    flush_range(pagemap, virt_addr, pages);
+
+    spinlock_release(&pagemap->lock);
+    interrupts_restore(rflags);
+
+    while (free_list) {
+        pt_entry_t *next = (pt_entry_t *)free_list[0];
+        pt_free(free_list);
+        free_list = next;
+    }
+
+    while (page_list) {
+        size_t next = *(size_t *)(page_list + MEM_PHYS_OFFSET);
+        pmm_free((void *)page_list, 1);
+        page_list = next;
+    }
+
+    while (large_page_list) {
+        size_t next = *(size_t *)(large_page_list + MEM_PHYS_OFFSET);
+        pmm_free((void *)large_page_list, PAGE_TABLE_ENTRIES);
+        large_page_list = next;
+    }
+
+    return ret;
+}
+
+int unmap_range(struct pagemap_t *pagemap, size_t virt_addr, size_t pages) {
+    return do_unmap_range(pagemap, virt_addr, pages, 0);
+}
+
+/* Unmap a range and drop its references to the pages it mapped, freeing the
+ * pages which are not mapped anywhere else. Only for ranges whose pages were
+ * allocated one by one, as they are freed one by one. */
+int release_range(struct pagemap_t *pagemap, size_t virt_addr, size_t pages) {
+    return do_unmap_range(pagemap, virt_addr, pages, 1);
+}
+
+/* Update flags for the mapped pages of a range */
+/* Returns -1 if any of the pages was not mapped */
+int protect_range(struct pagemap_t *pagemap, size_t virt_addr, size_t pages, size_t flags) {
+    int ret = 0;
+    pt_entry_t *pt = (void *)0;
+    /* A stale entry which grants less than the new one is harmless, the
+     * fault it causes finds the page accessible already and is retried.
+     * Only taking away access (present, write, user, or setting NX) or
+     * changing the caching type needs a flush. The accessed and dirty bits
+     * are kept, and ignored when comparing. */
+    int downgraded = 0;
+
+    virt_addr &= ~(PAGE_SIZE - 1);
+
+    if (virt_addr >= MEM_PHYS_OFFSET)
+        flags |= tlb_global_flag;
+
+    /* Large pages in the way have to be split */
+    pt_reserve_fill();
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->lock);
+
+    for (size_t i = 0; i < pages; i++) {
+        size_t virt = virt_addr + i * PAGE_SIZE;
+        size_t pt_entry = (virt & ((size_t)0x1ff << 12)) >> 12;
+
+        if (!pt || !pt_entry) {
+            if (!(pt = get_pt(pagemap, virt, 0))) {
+                ret = -1;
+                i += PAGE_TABLE_ENTRIES - pt_entry - 1;
+                continue;
+            }
+        }
+
+        if (!pt[pt_entry]) {
+            ret = -1;
+            continue;
         }
+
+        /* Update flags, copy-on-write pages stay read-only until copied */
+        pt_entry_t old = pt[pt_entry];
+        pt_entry_t new = (old & (PAGE_ADDR_MASK | PAGE_ACCESSED | PAGE_DIRTY)) | flags;
+        if (old & PAGE_COW)
+            new = (new | PAGE_COW) & ~(pt_entry_t)0x2;
+        pt[pt_entry] = new;
+
+        pt_entry_t removed = old & ~new & (0x1 | 0x2 | 0x4);
+        pt_entry_t cache_bits = (1 << 3) | (1 << 4) | PAGE_PAT;
+        if (removed || (new & ~old & PAGE_NX)
+         || (old & cache_bits) != (new & cache_bits))
+            downgraded = 1;
     }
 
-fail1:
+    if (downgraded)
+        flush_range(pagemap, virt_addr, pages);
+
     spinlock_release(&pagemap->lock);
-    return -1;
+    interrupts_restore(rflags);
+    return ret;
 }
 
-int unmap_page(struct pagemap_t *pagemap, size_t virt_addr) {
-    spinlock_acquire(&pagemap->lock);
+/* Account for a new page of anonymous user memory */
+static void anon_page_mapped(void *page) {
+    pmm_page((size_t)page)->flags |= PG_ANON;
+    pmm_mapcount_add((size_t)page, 1);
+}
 
-    /* Calculate the indices in the various tables using the virtual address */
-    size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
-    size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
-    size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
+/* Back a page of a process with a zeroed page mapped with `flags`, unless
+ * another thread of the process got to it first. Called by the page fault
+ * handler, with interrupts disabled. Returns 0 on success. */
+int vmm_back_page(struct pagemap_t *pagemap, size_t virt_addr, size_t flags) {
+    return vmm_back_page_copy(pagemap, virt_addr, flags, (void *)0, 0);
+}
+
+/* Like vmm_back_page(), with the first `len` bytes of the page copied from
+ * `src`, a kernel address */
+int vmm_back_page_copy(struct pagemap_t *pagemap, size_t virt_addr, size_t flags,
+                       const void *src, size_t len) {
     size_t pt_entry = (virt_addr & ((size_t)0x1ff << 12)) >> 12;
 
-    pt_entry_t *pdpt, *pd, *pt;
+    pt_reserve_fill();
 
-    /* Get reference to the various tables in sequence. Return -1 if one of the tables is not present,
-     * since we cannot unmap a virtual address if we don't know what it's mapped to in the first place */
-    if (pagemap->pml4[pml4_entry] & 0x1) {
-        pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->lock);
+
+    pt_entry_t *pt = get_pt(pagemap, virt_addr, 1);
+    if (!pt)
         goto fail;
+
+    /* Nothing to flush, since the entry was not present */
+    if (!(pt[pt_entry] & 0x1)) {
+        void *page = pmm_alloc(1);
+        if (!page)
+            goto fail;
+        kmemcpy((void *)((size_t)page + MEM_PHYS_OFFSET), src, len);
+        pt[pt_entry] = (pt_entry_t)page | flags | 0x1;
+        anon_page_mapped(page);
     }
 
-    if (pdpt[pdpt_entry] & 0x1) {
-        pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
+    spinlock_release(&pagemap->lock);
+    interrupts_restore(rflags);
+    return 0;
+
+fail:
+    spinlock_release(&pagemap->lock);
+    interrupts_restore(rflags);
+    return -1;
+}
+
+/* Map a page somebody else owns, such as a page of the file cache, into a
+ * process copy-on-write, so that writes get a private copy if `flags` ever
+ * allow them. Called by the page fault handler, with interrupts disabled.
+ * Returns 0 on success. */
+int vmm_map_cow_page(struct pagemap_t *pagemap, size_t virt_addr, size_t phys_addr, size_t flags) {
+    size_t pt_entry = (virt_addr & ((size_t)0x1ff << 12)) >> 12;
+
+    pt_reserve_fill();
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->lock);
+
+    pt_entry_t *pt = get_pt(pagemap, virt_addr, 1);
+    if (!pt) {
+        spinlock_release(&pagemap->lock);
+        interrupts_restore(rflags);
+        return -1;
     }
 
-    if (pd[pd_entry] & 0x1) {
-        pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
+    /* Nothing to flush, since the entry was not present */
+    if (!(pt[pt_entry] & 0x1)) {
+        pmm_ref((void *)phys_addr);
+        pmm_mapcount_add(phys_addr, 1);
+        pt[pt_entry] = (pt_entry_t)phys_addr | (flags & ~(pt_entry_t)0x2) | PAGE_COW | 0x1;
     }
 
-    /* Unmap entry */
-    pt[pt_entry] = 0;
+    spinlock_release(&pagemap->lock);
+    interrupts_restore(rflags);
+    return 0;
+}
+
+/* Back the 2 MiB of a process at virt_addr with a zeroed large page mapped
+ * with `flags`, if no part of it is mapped yet. Called by the page fault
+ * handler, with interrupts disabled. Returns 0 if the range is mapped by a
+ * large page, -1 if it has to be backed with 4 KiB pages. */
+int vmm_back_large_page(struct pagemap_t *pagemap, size_t virt_addr, size_t flags) {
+    int ret = -1;
+
+    virt_addr &= ~(LARGE_PAGE_SIZE - 1);
 
-    if ((size_t)pagemap->pml4 == read_cr3()) {
-        // TODO: TLB shootdown
-        invlpg(virt_addr);
+    pt_reserve_fill();
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->lock);
+
+    pt_entry_t *pd_entry = get_pd_entry(pagemap, virt_addr, 1);
+    if (!pd_entry)
+        goto out;
+
+    /* Another thread of the process got to it first */
+    if ((*pd_entry & 0x1) && (*pd_entry & PAGE_PS)) {
+        ret = 0;
+        goto out;
     }
 
-    /* Free previous levels if empty */
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pt - MEM_PHYS_OFFSET, 1);
-            break;
-        }
-        if (pt[i] & 0x1) {
-            /* Table is not free */
-            goto out;
+    /* There is a table, with 4 KiB pages in it or on their way */
+    if (*pd_entry)
+        goto out;
+
+    /* The buddy allocator hands out naturally aligned blocks */
+    void *page = pmm_alloc(PAGE_TABLE_ENTRIES);
+    if (!page)
+        goto out;
+
+    for (size_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+        pmm_page((size_t)page + i * PAGE_SIZE)->flags |= PG_ANON;
+        pmm_mapcount_add((size_t)page + i * PAGE_SIZE, 1);
+    }
+
+    /* Nothing to flush, since the entry was not present */
+    *pd_entry = (pt_entry_t)page | flags | PAGE_PS | 0x1;
+    ret = 0;
+
+out:
+    spinlock_release(&pagemap->lock);
+    interrupts_restore(rflags);
+    return ret;
+}
+
+/* Count the 4 KiB and 2 MiB pages mapped in the lower half of a pagemap */
+void vmm_stats(struct pagemap_t *pagemap, size_t *pages, size_t *large_pages) {
+    *pages = 0;
+    *large_pages = 0;
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->lock);
+
+    for (size_t i = 0; i < 256; i++) {
+        if (!(pagemap->pml4[i] & 0x1))
+            continue;
+        pt_entry_t *pdpt = (pt_entry_t *)((pagemap->pml4[i] & PAGE_ADDR_MASK) + MEM_PHYS_OFFSET);
+        for (size_t j = 0; j < PAGE_TABLE_ENTRIES; j++) {
+            if (!(pdpt[j] & 0x1) || (pdpt[j] & PAGE_PS))
+                continue;
+            pt_entry_t *pd = (pt_entry_t *)((pdpt[j] & PAGE_ADDR_MASK) + MEM_PHYS_OFFSET);
+            for (size_t k = 0; k < PAGE_TABLE_ENTRIES; k++) {
+                if (!(pd[k] & 0x1))
+                    continue;
+                if (pd[k] & PAGE_PS) {
+                    (*large_pages)++;
+                    continue;
+                }
+                pt_entry_t *pt = (pt_entry_t *)((pd[k] & PAGE_ADDR_MASK) + MEM_PHYS_OFFSET);
+                for (size_t l = 0; l < PAGE_TABLE_ENTRIES; l++) {
+                    if (pt[l] & 0x1)
+                        (*pages)++;
+                }
+            }
         }
     }
 
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pd - MEM_PHYS_OFFSET, 1);
-            break;
+    spinlock_release(&pagemap->lock);
+    interrupts_restore(rflags);
+}
+
+/* Share the pages mapped in a range of `src` with `dst`. If `cow` is set they
+ * are shared copy-on-write, and both pagemaps end up mapping them read-only,
+ * otherwise writes of either pagemap are seen by the other. The lock of
+ * `dst` is not taken, as it is not in use by anyone yet. */
+/* Returns 0 on success, -1 on failure */
+int vmm_share_range(struct pagemap_t *dst, struct pagemap_t *src, size_t virt_addr,
+                    size_t pages, int cow) {
+    int ret = 0;
+    pt_entry_t *src_pt = (void *)0;
+    pt_entry_t *dst_pt = (void *)0;
+    size_t i;
+
+    virt_addr &= ~(PAGE_SIZE - 1);
+
+    pt_reserve_fill();
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&src->lock);
+
+    for (i = 0; i < pages; i++) {
+        size_t virt = virt_addr + i * PAGE_SIZE;
+        size_t pt_entry = (virt & ((size_t)0x1ff << 12)) >> 12;
+
+        if (!src_pt || !pt_entry) {
+            dst_pt = (void *)0;
+            /* Large pages are split, so that they can be copied 4 KiB at a time */
+            pt_entry_t *pd_entry = get_pd_entry(src, virt, 0);
+            int large = pd_entry && (*pd_entry & PAGE_PS);
+            if (!(src_pt = get_pt(src, virt, 0))) {
+                if (large) {
+                    ret = -1;
+                    break;
+                }
+                i += PAGE_TABLE_ENTRIES - pt_entry - 1;
+                continue;
+            }
         }
-        if (pd[i] & 0x1) {
-            /* Table is not free */
-            goto out;
+
+        if (!(src_pt[pt_entry] & 0x1))
+            continue;
+
+        /* Only allocate tables in `dst` for the ranges with pages in them */
+        if (!dst_pt) {
+            if (!(dst_pt = get_pt(dst, virt, 1))) {
+                ret = -1;
+                break;
+            }
         }
-    }
 
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pdpt - MEM_PHYS_OFFSET, 1);
-            break;
+        if (cow) {
+            if (src_pt[pt_entry] & 0x2)
+                src_pt[pt_entry] = (src_pt[pt_entry] & ~(pt_entry_t)0x2) | PAGE_COW;
+            else if (!(src_pt[pt_entry] & PAGE_COW))
+                src_pt[pt_entry] |= PAGE_COW;
         }
-        if (pdpt[i] & 0x1) {
-            /* Table is not free */
+
+        size_t phys = src_pt[pt_entry] & PAGE_ADDR_MASK;
+        pmm_ref((void *)phys);
+        pmm_mapcount_add(phys, 1);
+        dst_pt[pt_entry] = src_pt[pt_entry];
+    }
+
+    /* The pages of `src` which were writable are not anymore */
+    if (cow)
+        flush_range(src, virt_addr, MIN(i, pages));
+
+    spinlock_release(&src->lock);
+    interrupts_restore(rflags);
+    return ret;
+}
+
+/* Resolve a write fault on a copy-on-write page by giving the pagemap its
+ * own copy, mapped with `flags`. The last mapping left takes the page over
+ * without copying it. Called by the page fault handler, with interrupts
+ * disabled. Returns 0 on success, -1 if the page is not copy-on-write. */
+int vmm_break_cow(struct pagemap_t *pagemap, size_t virt_addr, size_t flags) {
+    size_t pt_entry = (virt_addr & ((size_t)0x1ff << 12)) >> 12;
+
+    virt_addr &= ~(PAGE_SIZE - 1);
+
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->lock);
+
+    pt_entry_t *pt = get_pt(pagemap, virt_addr, 0);
+    if (!pt || !(pt[pt_entry] & 0x1))
+        goto fail;
+
+    if (!(pt[pt_entry] & PAGE_COW)) {
+        /* Another thread of the process got to it first */
+        if (pt[pt_entry] & 0x2)
             goto out;
-        }
+        goto fail;
+    }
+
+    void *page = (void *)(size_t)(pt[pt_entry] & PAGE_ADDR_MASK);
+
+    if (pmm_shared(page)) {
+        void *copy = pmm_alloc_flags(1, PMM_NOZERO);
+        if (!copy)
+            goto fail;
+        kmemcpy((void *)((size_t)copy + MEM_PHYS_OFFSET),
+                (void *)((size_t)page + MEM_PHYS_OFFSET), PAGE_SIZE);
+        pt[pt_entry] = (pt_entry_t)copy | flags | 0x1;
+        anon_page_mapped(copy);
+        pmm_mapcount_add((size_t)page, -1);
+        /* The other mappings may have gone away in the meantime */
+        if (pmm_unref(page))
+            pmm_free(page, 1);
+        /* The other CPUs may still have the old page cached */
+        flush_range(pagemap, virt_addr, 1);
+    } else {
+        /* Only the write bit was added, see protect_range() */
+        pt[pt_entry] = (pt_entry_t)page | flags | 0x1;
     }
 
 out:
     spinlock_release(&pagemap->lock);
+    interrupts_restore(rflags);
     return 0;
 
 fail:
     spinlock_release(&pagemap->lock);
+    interrupts_restore(rflags);
     return -1;
 }
 
+/* Allocate an empty pagemap for a new process. The higher half is added
+ * by task_pcreate(). */
+struct pagemap_t *new_pagemap(void) {
+    struct pagemap_t *pagemap = kalloc(sizeof(struct pagemap_t));
+    if (!pagemap)
+        return (void *)0;
+
+    void *pml4 = pmm_alloc(1);
+    if (!pml4) {
+        kfree(pagemap);
+        return (void *)0;
+    }
+
+    pagemap->pml4 = (pt_entry_t *)((size_t)pml4 + MEM_PHYS_OFFSET);
+    spinlock_release(&pagemap->lock);
+    /* A generation no PCID can have cached entries for */
+    pagemap->tlb_gen = tlb_new_generation();
+    pagemap->vmas = (void *)0;
+    spinlock_release(&pagemap->vma_lock);
+
+    return pagemap;
+}
+
+/* Pages freed by free_pagemap(), handed to the PMM this many at a time */
+#define FREE_BATCH_SIZE 64
+
+struct free_batch_t {
+    size_t count;
+    size_t pages[FREE_BATCH_SIZE];
+};
+
+static void batch_free(struct free_batch_t *batch, size_t phys) {
+    if (batch->count == FREE_BATCH_SIZE) {
+        pmm_free_batch(batch->pages, batch->count);
+        batch->count = 0;
+    }
+    batch->pages[batch->count++] = phys;
+}
+
+/* Drop a large page mapping's references to its pages, freeing the block
+ * whole if no one else maps any of it */
+static void release_large_page(struct free_batch_t *batch, size_t phys) {
+    size_t page_list = 0;
+
+    if (unref_large_page(phys, &page_list)) {
+        pmm_free((void *)phys, PAGE_TABLE_ENTRIES);
+        return;
+    }
+
+    while (page_list) {
+        size_t next = *(size_t *)(page_list + MEM_PHYS_OFFSET);
+        batch_free(batch, page_list);
+        page_list = next;
+    }
+}
+
+/* Free a pagemap, the tables of its lower half and the pages they map which
+ * are not mapped anywhere else, walking the tables once. Unlike unmapping
+ * the lower half, nothing is flushed: no CPU may have the pagemap loaded
+ * anymore, and the PCIDs which cached it notice that a pagemap reusing its
+ * memory has a new generation. */
+void free_pagemap(struct pagemap_t *pagemap) {
+    struct free_batch_t batch;
+    batch.count = 0;
+
+    for (size_t i = 0; i < 256; i++) {
+        if (!(pagemap->pml4[i] & 0x1))
+            continue;
+        pt_entry_t *pdpt = (pt_entry_t *)((pagemap->pml4[i] & PAGE_ADDR_MASK) + MEM_PHYS_OFFSET);
+
+        for (size_t j = 0; j < PAGE_TABLE_ENTRIES; j++) {
+            /* Processes are never given 1 GiB pages */
+            if (!(pdpt[j] & 0x1) || (pdpt[j] & PAGE_PS))
+                continue;
+            pt_entry_t *pd = (pt_entry_t *)((pdpt[j] & PAGE_ADDR_MASK) + MEM_PHYS_OFFSET);
+
+            for (size_t k = 0; k < PAGE_TABLE_ENTRIES; k++) {
+                if (!(pd[k] & 0x1))
+                    continue;
+                if (pd[k] & PAGE_PS) {
+                    release_large_page(&batch, pd[k] & PAGE_ADDR_MASK & ~(LARGE_PAGE_SIZE - 1));
+                    continue;
+                }
+                pt_entry_t *pt = (pt_entry_t *)((pd[k] & PAGE_ADDR_MASK) + MEM_PHYS_OFFSET);
+
+                for (size_t l = 0; l < PAGE_TABLE_ENTRIES; l++) {
+                    if (!(pt[l] & 0x1))
+                        continue;
+                    size_t phys = pt[l] & PAGE_ADDR_MASK;
+                    pmm_mapcount_add(phys, -1);
+                    /* Shared pages are left to their other mappings */
+                    if (pmm_unref((void *)phys))
+                        batch_free(&batch, phys);
+                }
+
+                batch_free(&batch, (size_t)pt - MEM_PHYS_OFFSET);
+            }
+
+            batch_free(&batch, (size_t)pd - MEM_PHYS_OFFSET);
+        }
+
+        batch_free(&batch, (size_t)pdpt - MEM_PHYS_OFFSET);
+    }
+
+    batch_free(&batch, (size_t)pagemap->pml4 - MEM_PHYS_OFFSET);
+    pmm_free_batch(batch.pages, batch.count);
+
+    kfree(pagemap);
+}
+
+/* map physaddr -> virtaddr using pml4 pointer */
+/* Returns 0 on success, -1 on failure */
+int map_page(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr, size_t flags) {
+    return map_range(pagemap, phys_addr, virt_addr, 1, flags);
+}
+
+int unmap_page(struct pagemap_t *pagemap, size_t virt_addr) {
+    return unmap_range(pagemap, virt_addr, 1);
+}
+
 /* Update flags for a mapping */
 int remap_page(struct pagemap_t *pagemap, size_t virt_addr, size_t flags) {
-    spinlock_acquire(&pagemap->lock);
+    return protect_range(pagemap, virt_addr, 1, flags);
+}
+
+/* Returns the physical address virt_addr is mapped to, or -1 if it is not mapped */
+size_t virt_to_phys(struct pagemap_t *pagemap, size_t virt_addr) {
+    uint64_t rflags = interrupts_save();
+    tlb_spinlock_acquire(&pagemap->lock);
 
     /* Calculate the indices in the various tables using the virtual address */
     size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
@@ -201,63 +917,142 @@ int remap_page(struct pagemap_t *pagemap, size_t virt_addr, size_t flags) {
     size_t pt_entry = (virt_addr & ((size_t)0x1ff << 12)) >> 12;
 
     pt_entry_t *pdpt, *pd, *pt;
+    size_t phys_addr;
 
-    /* Get reference to the various tables in sequence. Return -1 if one of the tables is not present,
-     * since we cannot unmap a virtual address if we don't know what it's mapped to in the first place */
     if (pagemap->pml4[pml4_entry] & 0x1) {
         pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
     } else {
         goto fail;
     }
 
-    if (pdpt[pdpt_entry] & 0x1) {
-        pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
+    if (!(pdpt[pdpt_entry] & 0x1))
         goto fail;
+    if (pdpt[pdpt_entry] & PAGE_PS) {
+        phys_addr = (pdpt[pdpt_entry] & PAGE_ADDR_MASK & ~(HUGE_PAGE_SIZE - 1))
+                  | (virt_addr & (HUGE_PAGE_SIZE - 1));
+        goto out;
     }
+    pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
 
-    if (pd[pd_entry] & 0x1) {
-        pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
+    if (!(pd[pd_entry] & 0x1))
         goto fail;
+    if (pd[pd_entry] & PAGE_PS) {
+        phys_addr = (pd[pd_entry] & PAGE_ADDR_MASK & ~(LARGE_PAGE_SIZE - 1))
+                  | (virt_addr & (LARGE_PAGE_SIZE - 1));
+        goto out;
     }
+    pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
 
-    /* Update flags */
-    pt[pt_entry] = (pt[pt_entry] & 0xfffffffffffff000) | flags;
+    if (!(pt[pt_entry] & 0x1))
+        goto fail;
 
-    if ((size_t)pagemap->pml4 == read_cr3()) {
-        // TODO: TLB shootdown
-        invlpg(virt_addr);
-    }
+    phys_addr = (pt[pt_entry] & PAGE_ADDR_MASK) | (virt_addr & (PAGE_SIZE - 1));
 
+out:
     spinlock_release(&pagemap->lock);
-    return 0;
+    interrupts_restore(rflags);
+    return phys_addr;
 
 fail:
     spinlock_release(&pagemap->lock);
-    return -1;
+    interrupts_restore(rflags);
+    return (size_t)-1;
+}
+
+/* Map a `page_size` (2 MiB or 1 GiB) page. Returns 1 if there is already
+ * a page table in the way, -1 on failure. The pagemap lock must be held. */
+static int map_large_page(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr,
+                          size_t flags, size_t page_size) {
+    size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
+    size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
+    size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
+
+    pt_entry_t *table, *entry;
+
+    if (!(table = next_level(pagemap->pml4, pml4_entry, 0, 1)))
+        return -1;
+
+    if (page_size == HUGE_PAGE_SIZE) {
+        entry = &table[pdpt_entry];
+    } else {
+        if (!(table = next_level(table, pdpt_entry, HUGE_PAGE_SIZE, 1)))
+            return -1;
+        entry = &table[pd_entry];
+    }
+
+    if ((*entry & 0x1) && !(*entry & PAGE_PS))
+        return 1;
+
+    if (virt_addr >= MEM_PHYS_OFFSET)
+        flags |= tlb_global_flag;
+
+    *entry = (pt_entry_t)(phys_addr | flags | PAGE_PS);
+
+    return 0;
+}
+
+/* Map a physical range, using the largest pages its alignment allows.
+ * Used for the kernel's own mappings, which are never torn down. */
+static void map_phys_range(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr,
+                           size_t length, size_t flags) {
+    size_t end = phys_addr + length;
+
+    while (phys_addr < end) {
+        size_t page_size = PAGE_SIZE;
+
+        uint64_t rflags = interrupts_save();
+        tlb_spinlock_acquire(&pagemap->lock);
+
+        if (huge_pages
+         && !(phys_addr % HUGE_PAGE_SIZE) && !(virt_addr % HUGE_PAGE_SIZE)
+         && end - phys_addr >= HUGE_PAGE_SIZE
+         && !map_large_page(pagemap, phys_addr, virt_addr, flags, HUGE_PAGE_SIZE)) {
+            page_size = HUGE_PAGE_SIZE;
+        } else if (!(phys_addr % LARGE_PAGE_SIZE) && !(virt_addr % LARGE_PAGE_SIZE)
+         && end - phys_addr >= LARGE_PAGE_SIZE
+         && !map_large_page(pagemap, phys_addr, virt_addr, flags, LARGE_PAGE_SIZE)) {
+            page_size = LARGE_PAGE_SIZE;
+        }
+
+        spinlock_release(&pagemap->lock);
+        interrupts_restore(rflags);
+
+        if (page_size == PAGE_SIZE)
+            map_page(pagemap, phys_addr, virt_addr, flags);
+
+        phys_addr += page_size;
+        virt_addr += page_size;
+    }
 }
 
 /* Map the first 4GiB of memory, this saves issues with MMIO hardware < 4GiB later on */
 /* Then use the e820 to map all the available memory (saves on allocation time and it's easier) */
 /* The physical memory is mapped at the beginning of the higher half (entry 256 of the pml4) onwards */
+/* Where the alignment allows it, 1 GiB or 2 MiB pages are used. They are split
+ * when a single page is remapped or unmapped, e.g. for MMIO or guard pages */
 void init_vmm(void) {
     kernel_pagemap.pml4 = (pt_entry_t *)((size_t)pmm_alloc(1) + MEM_PHYS_OFFSET);
     if ((size_t)kernel_pagemap.pml4 == MEM_PHYS_OFFSET)
         panic("init_vmm failure", 0, 0);
 
     spinlock_release(&kernel_pagemap.lock);
+    spinlock_release(&kernel_pagemap.vma_lock);
+
+    init_tlb();
+
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (edx & (1 << 26)))
+        huge_pages = 1;
 
     kprint(KPRN_INFO, "vmm: Mapping memory as specified by the e820...");
+    kprint(KPRN_INFO, "vmm: Using %s pages for the physical memory map",
+           huge_pages ? "1 GiB" : "2 MiB");
 
     /* Identity map the first 32 MiB */
     /* Map 32 MiB for the phys mem area, and 32 MiB for the kernel in the higher half */
-    for (size_t i = 0; i < (0x2000000 / PAGE_SIZE); i++) {
-        size_t addr = i * PAGE_SIZE;
-        map_page(&kernel_pagemap, addr, addr, 0x03);
-        map_page(&kernel_pagemap, addr, MEM_PHYS_OFFSET + addr, 0x03);
-        map_page(&kernel_pagemap, addr, KERNEL_PHYS_OFFSET + addr, 0x03);
-    }
+    map_phys_range(&kernel_pagemap, 0, 0, 0x2000000, 0x03);
+    map_phys_range(&kernel_pagemap, 0, MEM_PHYS_OFFSET, 0x2000000, 0x03);
+    map_phys_range(&kernel_pagemap, 0, KERNEL_PHYS_OFFSET, 0x2000000, 0x03);
 
     /* Reload new pagemap */
     asm volatile (
@@ -267,11 +1062,7 @@ void init_vmm(void) {
     );
 
     /* Forcefully map the first 4 GiB for I/O into the higher half */
-    for (size_t i = 0; i < (0x100000000 / PAGE_SIZE); i++) {
-        size_t addr = i * PAGE_SIZE;
-
-        map_page(&kernel_pagemap, addr, MEM_PHYS_OFFSET + addr, 0x03);
-    }
+    map_phys_range(&kernel_pagemap, 0, MEM_PHYS_OFFSET, 0x100000000, 0x03);
 
     /* Map the rest according to e820 into the higher half */
     for (size_t i = 0; e820_map[i].type; i++) {
@@ -280,15 +1071,16 @@ void init_vmm(void) {
         if (e820_map[i].length % PAGE_SIZE) aligned_length += PAGE_SIZE;
         if (e820_map[i].base % PAGE_SIZE) aligned_length += PAGE_SIZE;
 
-        for (size_t j = 0; j * PAGE_SIZE < aligned_length; j++) {
-            size_t addr = aligned_base + j * PAGE_SIZE;
-
-            /* Skip over first 4 GiB */
-            if (addr < 0x100000000)
-                continue;
-
-            map_page(&kernel_pagemap, addr, MEM_PHYS_OFFSET + addr, 0x03);
+        /* Skip over first 4 GiB */
+        if (aligned_base + aligned_length <= 0x100000000)
+            continue;
+        if (aligned_base < 0x100000000) {
+            aligned_length -= 0x100000000 - aligned_base;
+            aligned_base = 0x100000000;
         }
+
+        map_phys_range(&kernel_pagemap, aligned_base, MEM_PHYS_OFFSET + aligned_base,
+                       aligned_length, 0x03);
     }
 
     return;
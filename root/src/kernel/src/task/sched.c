@@ -0,0 +1,882 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <sched.h>
+#include <task.h>
+#include <smp.h>
+#include <lock.h>
+#include <klib.h>
+#include <time.h>
+#include <apic.h>
+#include <ipi.h>
+
+/* Every thread which has been added and not removed is on exactly one of
+ * the run queues, in the CPU local of the CPU it runs on.
+ *
+ * Threads are scheduled fairly by weight. Each one accounts the time it
+ * runs as vruntime, in microseconds scaled down by its weight. The next
+ * thread picked is the one with the least vruntime, so that over
+ * SCHED_LATENCY_MS every runnable thread gets a share of the CPU in
+ * proportion to its weight, which comes from the priority of its process.
+ *
+ * A CPU which runs out of threads steals one from the longest
+ * queue, and every SCHED_BALANCE_INTERVAL it pulls one from a queue longer
+ * than its own. */
+
+/* Threads which ran less than this many ms ago likely still have their
+ * working set in the cache of their CPU, and are not migrated */
+#define SCHED_MIGRATION_COST 2
+/* How often, in ms, a CPU looks for a queue to even its own out with */
+#define SCHED_BALANCE_INTERVAL 50
+
+void sched_init_cpu(int cpu) {
+    struct run_queue_t *rq = &cpu_locals[cpu].run_queue;
+
+    rq->root = NULL;
+    rq->nr_runnable = 0;
+    rq->load = 0;
+    rq->min_vruntime = 0;
+    rq->wheel.now = uptime_raw;
+    for (int i = 0; i < WHEEL_LEVELS; i++)
+        rq->wheel.bitmap[i] = 0;
+    rq->current = NULL;
+    rq->next_balance = 0;
+    rq->nr_migrations = 0;
+    rq->nr_steals = 0;
+    spinlock_release(&rq->lock);
+}
+
+/* Weights by priority, from -20 to 19, each step being worth about 10%
+ * of CPU time against a thread one step apart. Priority 0 weighs
+ * NICE_0_WEIGHT. */
+static const uint32_t prio_to_weight[SCHED_PRIO_MAX - SCHED_PRIO_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,  3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,   335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,    36,    29,    23,    18,    15,
+};
+
+#define NICE_0_WEIGHT 1024
+
+static uint64_t sched_weight(int priority) {
+    if (priority < SCHED_PRIO_MIN)
+        priority = SCHED_PRIO_MIN;
+    if (priority > SCHED_PRIO_MAX)
+        priority = SCHED_PRIO_MAX;
+    return prio_to_weight[priority - SCHED_PRIO_MIN];
+}
+
+/* AVL tree of the runnable threads by vruntime, ties broken by task ID.
+ * Each helper returns the new root of the subtree. */
+
+static int thread_before(struct thread_t *a, struct thread_t *b) {
+    if (a->vruntime != b->vruntime)
+        return a->vruntime < b->vruntime;
+    return a->task_id < b->task_id;
+}
+
+static int height(struct thread_t *node) {
+    return node ? node->height : 0;
+}
+
+static void update_height(struct thread_t *node) {
+    int left = height(node->left);
+    int right = height(node->right);
+
+    node->height = (left > right ? left : right) + 1;
+}
+
+static struct thread_t *rotate_right(struct thread_t *node) {
+    struct thread_t *left = node->left;
+
+    node->left = left->right;
+    left->right = node;
+    update_height(node);
+    update_height(left);
+
+    return left;
+}
+
+static struct thread_t *rotate_left(struct thread_t *node) {
+    struct thread_t *right = node->right;
+
+    node->right = right->left;
+    right->left = node;
+    update_height(node);
+    update_height(right);
+
+    return right;
+}
+
+static struct thread_t *rebalance(struct thread_t *node) {
+    update_height(node);
+
+    int balance = height(node->left) - height(node->right);
+
+    if (balance > 1) {
+        if (height(node->left->left) < height(node->left->right))
+            node->left = rotate_left(node->left);
+        return rotate_right(node);
+    }
+
+    if (balance < -1) {
+        if (height(node->right->right) < height(node->right->left))
+            node->right = rotate_right(node->right);
+        return rotate_left(node);
+    }
+
+    return node;
+}
+
+static struct thread_t *tree_insert(struct thread_t *root, struct thread_t *thread) {
+    if (!root) {
+        thread->left = NULL;
+        thread->right = NULL;
+        thread->height = 1;
+        return thread;
+    }
+
+    if (thread_before(thread, root))
+        root->left = tree_insert(root->left, thread);
+    else
+        root->right = tree_insert(root->right, thread);
+
+    return rebalance(root);
+}
+
+static struct thread_t *tree_remove_min(struct thread_t *root, struct thread_t **min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = tree_remove_min(root->left, min);
+
+    return rebalance(root);
+}
+
+static struct thread_t *tree_remove(struct thread_t *root, struct thread_t *thread) {
+    if (!root)
+        return NULL;
+
+    if (thread == root) {
+        struct thread_t *left = root->left;
+        struct thread_t *right = root->right;
+        struct thread_t *min;
+
+        if (!right)
+            return left;
+
+        right = tree_remove_min(right, &min);
+        min->left = left;
+        min->right = right;
+        return rebalance(min);
+    }
+
+    if (thread_before(thread, root))
+        root->left = tree_remove(root->left, thread);
+    else
+        root->right = tree_remove(root->right, thread);
+
+    return rebalance(root);
+}
+
+static struct thread_t *tree_min(struct thread_t *node) {
+    if (node) {
+        while (node->left)
+            node = node->left;
+    }
+    return node;
+}
+
+static void rq_push(struct run_queue_t *rq, struct thread_t *thread) {
+    thread->state = TASK_RUNNABLE;
+    rq->root = tree_insert(rq->root, thread);
+    rq->nr_runnable++;
+    rq->load += thread->weight;
+}
+
+static void rq_remove(struct run_queue_t *rq, struct thread_t *thread) {
+    rq->root = tree_remove(rq->root, thread);
+    rq->nr_runnable--;
+    rq->load -= thread->weight;
+}
+
+/* The first thread in vruntime order allowed to run on `cpu` */
+static struct thread_t *find_allowed(struct thread_t *node, int cpu) {
+    if (!node)
+        return NULL;
+
+    struct thread_t *thread = find_allowed(node->left, cpu);
+    if (thread)
+        return thread;
+    if (cpumask_test(&node->affinity, cpu))
+        return node;
+    return find_allowed(node->right, cpu);
+}
+
+/* Take the thread which is owed the most CPU time off the queue of `cpu`.
+ * Threads not allowed on the CPU wait there for another one to pull them. */
+static struct thread_t *rq_pop(struct run_queue_t *rq, int cpu) {
+    struct thread_t *thread = tree_min(rq->root);
+    if (thread && !cpumask_test(&thread->affinity, cpu))
+        thread = find_allowed(rq->root, cpu);
+    if (thread)
+        rq_remove(rq, thread);
+    return thread;
+}
+
+/* vruntime only means something relative to the min_vruntime of a queue,
+ * keep the thread's lag when moving it to another one */
+static void move_vruntime(struct thread_t *thread, struct run_queue_t *from,
+                          struct run_queue_t *to) {
+    int64_t lag = thread->vruntime - from->min_vruntime;
+
+    if (lag < 0 && (uint64_t)-lag > to->min_vruntime)
+        thread->vruntime = 0;
+    else
+        thread->vruntime = to->min_vruntime + lag;
+}
+
+/* A thread waking up gets ahead of the others by at most half the latency
+ * target, so that it runs soon, without having saved up the time it slept
+ * for */
+static void place_woken(struct run_queue_t *rq, struct thread_t *thread) {
+    uint64_t credit = SCHED_LATENCY_MS * 1000 / 2;
+
+    if (rq->min_vruntime > credit && thread->vruntime < rq->min_vruntime - credit)
+        thread->vruntime = rq->min_vruntime - credit;
+}
+
+/* How long the thread picked gets to run: its share of the latency
+ * target, by weight against the threads waiting */
+static uint64_t timeslice(struct run_queue_t *rq, struct thread_t *thread) {
+    uint64_t slice = SCHED_LATENCY_MS * thread->weight / (rq->load + thread->weight);
+
+    return slice < SCHED_MIN_GRANULARITY_MS ? SCHED_MIN_GRANULARITY_MS : slice;
+}
+
+static int least_loaded_cpu(struct thread_t *);
+
+/* Move a thread which is on no queue from `rq`, the locked queue of its
+ * CPU, to the queue of CPU `target`. Queues are locked in CPU order, one
+ * below the thread's CPU is only tried, so that CPUs moving threads to
+ * each other cannot deadlock. */
+/* Returns 1 if the thread was moved */
+static int push_other(struct run_queue_t *rq, struct thread_t *thread, int target) {
+    struct run_queue_t *target_rq = &cpu_locals[target].run_queue;
+
+    if (target > thread->cpu)
+        spinlock_acquire(&target_rq->lock);
+    else if (!spinlock_test_and_acquire(&target_rq->lock))
+        return 0;
+
+    move_vruntime(thread, rq, target_rq);
+    thread->cpu = target;
+    rq_push(target_rq, thread);
+    int idle = !target_rq->current;
+
+    spinlock_release(&target_rq->lock);
+
+    if (idle && target != current_cpu)
+        lapic_send_ipi(IPI_RESCHED, cpu_locals[target].lapic_id);
+
+    return 1;
+}
+
+/* Make a thread of the locked queue `rq` runnable again, on another CPU if
+ * its affinity no longer allows the one it is on */
+static void rq_push_allowed(struct run_queue_t *rq, struct thread_t *thread) {
+    if (!cpumask_test(&thread->affinity, thread->cpu)) {
+        int target = least_loaded_cpu(thread);
+        if (target != -1 && push_other(rq, thread, target))
+            return;
+    }
+
+    rq_push(rq, thread);
+}
+
+static void wheel_insert(struct run_queue_t *rq, struct thread_t *thread) {
+    struct timer_wheel_t *wheel = &rq->wheel;
+    uint64_t deadline = thread->yield_target;
+
+    if (deadline <= wheel->now) {
+        place_woken(rq, thread);
+        rq_push_allowed(rq, thread);
+        return;
+    }
+
+    int level;
+    uint64_t slot;
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        slot = deadline >> (level * WHEEL_BITS);
+        if (slot - (wheel->now >> (level * WHEEL_BITS)) < WHEEL_SIZE)
+            break;
+    }
+    if (level == WHEEL_LEVELS) {
+        /* Too far away, wait in the last slot of the top level and get
+         * inserted again from there */
+        level = WHEEL_LEVELS - 1;
+        slot = (wheel->now >> (level * WHEEL_BITS)) + WHEEL_SIZE - 1;
+    }
+    slot &= WHEEL_SIZE - 1;
+
+    thread->state = TASK_SLEEPING;
+    thread->wheel_level = level;
+    thread->wheel_slot = slot;
+    thread->prev = NULL;
+    thread->next = wheel->slots[level][slot];
+    if (thread->next)
+        thread->next->prev = thread;
+    wheel->slots[level][slot] = thread;
+    wheel->bitmap[level] |= (uint64_t)1 << slot;
+}
+
+/* The first time after `now` when a slot is due: a level 0 one expires, or
+ * an upper level one gets spread over the levels below */
+/* Returns 0 if the wheel is empty */
+static uint64_t wheel_next(struct timer_wheel_t *wheel) {
+    uint64_t next = 0;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        uint64_t bitmap = wheel->bitmap[level];
+        if (!bitmap)
+            continue;
+
+        int shift = level * WHEEL_BITS;
+        uint64_t slot = (wheel->now >> shift) + 1;
+        int rot = slot & (WHEEL_SIZE - 1);
+        /* Rotate the slot after the current one to bit 0 */
+        if (rot)
+            bitmap = (bitmap >> rot) | (bitmap << (WHEEL_SIZE - rot));
+        slot += __builtin_ctzll(bitmap);
+
+        if (!next || (slot << shift) < next)
+            next = slot << shift;
+    }
+
+    return next;
+}
+
+/* Move the wheel up to `time`, waking up the threads whose deadline is
+ * reached. Only the due slots are visited, however long it has been. */
+static void wheel_advance(struct run_queue_t *rq, uint64_t time) {
+    struct timer_wheel_t *wheel = &rq->wheel;
+
+    for (;;) {
+        uint64_t next = wheel_next(wheel);
+        if (!next || next > time)
+            break;
+
+        wheel->now = next;
+
+        /* Top level first, so that what it holds can go all the way down
+         * to the level 0 slot expiring now */
+        for (int level = WHEEL_LEVELS - 1; level >= 0; level--) {
+            int shift = level * WHEEL_BITS;
+            if (next & (((uint64_t)1 << shift) - 1))
+                continue;
+
+            int slot = (next >> shift) & (WHEEL_SIZE - 1);
+            struct thread_t *thread = wheel->slots[level][slot];
+            wheel->slots[level][slot] = NULL;
+            wheel->bitmap[level] &= ~((uint64_t)1 << slot);
+
+            while (thread) {
+                struct thread_t *following = thread->next;
+                wheel_insert(rq, thread);
+                thread = following;
+            }
+        }
+    }
+
+    if (time > wheel->now)
+        wheel->now = time;
+}
+
+/* Lock the run queue a thread is on. Interrupts should be OFF */
+static struct run_queue_t *lock_thread_rq(struct thread_t *thread) {
+    for (;;) {
+        int cpu = *(volatile int *)&thread->cpu;
+        struct run_queue_t *rq = &cpu_locals[cpu].run_queue;
+        spinlock_acquire(&rq->lock);
+        /* The thread may have moved while we were waiting */
+        if (thread->cpu == cpu)
+            return rq;
+        spinlock_release(&rq->lock);
+    }
+}
+
+/* The CPU with the fewest threads to run of those the thread may run on */
+/* Returns -1 if there is none */
+static int least_loaded_cpu(struct thread_t *thread) {
+    int best = -1;
+    size_t best_load = (size_t)-1;
+
+    for (int i = 0; i < smp_cpu_count; i++) {
+        if (!cpumask_test(&thread->affinity, i))
+            continue;
+        struct run_queue_t *rq = &cpu_locals[i].run_queue;
+        size_t load = rq->nr_runnable + (rq->current != NULL);
+        if (load < best_load) {
+            best = i;
+            best_load = load;
+        }
+    }
+
+    return best;
+}
+
+/* The CPU other than `self` with the most threads waiting to run, if more
+ * than `min` of them */
+/* Returns -1 if there is none */
+static int busiest_cpu(int self, size_t min) {
+    int busiest = -1;
+
+    for (int i = 0; i < smp_cpu_count; i++) {
+        if (i == self)
+            continue;
+        size_t load = cpu_locals[i].run_queue.nr_runnable;
+        if (load > min) {
+            busiest = i;
+            min = load;
+        }
+    }
+
+    return busiest;
+}
+
+/* The first thread of the queue of CPU `src` in vruntime order which may
+ * move to CPU `dst`: allowed to run there, and not cache hot unless it is
+ * not allowed to stay */
+static struct thread_t *find_cold(struct thread_t *node, int src, int dst, uint64_t now) {
+    if (!node)
+        return NULL;
+
+    struct thread_t *thread = find_cold(node->left, src, dst, now);
+    if (thread)
+        return thread;
+    if (cpumask_test(&node->affinity, dst)
+     && (now - node->last_ran >= SCHED_MIGRATION_COST || !cpumask_test(&node->affinity, src)))
+        return node;
+    return find_cold(node->right, src, dst, now);
+}
+
+/* Move the first thread of the queue of CPU `src` which is not cache hot
+ * to `rq`, the locked queue of CPU `self`. The other queue is only tried
+ * once, so that two CPUs pulling from each other cannot deadlock. */
+/* Returns 1 if a thread was moved */
+static int pull_thread(struct run_queue_t *rq, int self, int src) {
+    struct run_queue_t *src_rq = &cpu_locals[src].run_queue;
+
+    if (!spinlock_test_and_acquire(&src_rq->lock))
+        return 0;
+
+    struct thread_t *thread = find_cold(src_rq->root, src, self, uptime_raw);
+
+    if (thread) {
+        rq_remove(src_rq, thread);
+        move_vruntime(thread, src_rq, rq);
+        thread->cpu = self;
+        rq_push(rq, thread);
+        rq->nr_migrations++;
+    }
+
+    spinlock_release(&src_rq->lock);
+
+    return thread != NULL;
+}
+
+/* Find work for the locked queue of this CPU in the other ones */
+static void balance(struct run_queue_t *rq, int self) {
+    if (!rq->root) {
+        int src = busiest_cpu(self, 0);
+        if (src != -1 && pull_thread(rq, self, src))
+            rq->nr_steals++;
+        return;
+    }
+
+    if (uptime_raw < rq->next_balance)
+        return;
+    rq->next_balance = uptime_raw + SCHED_BALANCE_INTERVAL;
+
+    /* Only pull when it evens the queues out, not just moves the
+     * imbalance over here */
+    int src = busiest_cpu(self, rq->nr_runnable + 1);
+    if (src != -1)
+        pull_thread(rq, self, src);
+}
+
+/* Get an idle CPU to come and steal the threads waiting on this one */
+static void kick_idle_cpu(int self) {
+    for (int i = 0; i < smp_cpu_count; i++) {
+        struct run_queue_t *rq = &cpu_locals[i].run_queue;
+        if (i != self && !rq->current && !rq->nr_runnable) {
+            lapic_send_ipi(IPI_RESCHED, cpu_locals[i].lapic_id);
+            return;
+        }
+    }
+}
+
+/* Make a new thread runnable, on the least loaded CPU */
+void sched_add(struct thread_t *thread) {
+    thread->weight = sched_weight(process_table[thread->process]->priority);
+
+    uint64_t rflags = interrupts_save();
+
+    int cpu = least_loaded_cpu(thread);
+    if (cpu == -1)
+        cpu = current_cpu;
+    struct run_queue_t *rq = &cpu_locals[cpu].run_queue;
+
+    spinlock_acquire(&rq->lock);
+    thread->cpu = cpu;
+    /* Start level with the threads already there */
+    thread->vruntime = rq->min_vruntime;
+    thread->runtime = 0;
+    rq_push(rq, thread);
+    int idle = !rq->current;
+    spinlock_release(&rq->lock);
+
+    /* An idle CPU would only notice at its next tick */
+    if (idle && cpu != current_cpu)
+        lapic_send_ipi(IPI_RESCHED, cpu_locals[cpu].lapic_id);
+
+    interrupts_restore(rflags);
+}
+
+/* Change the weight of a thread to that of `priority` */
+void sched_set_priority(struct thread_t *thread, int priority) {
+    uint64_t rflags = interrupts_save();
+    struct run_queue_t *rq = lock_thread_rq(thread);
+
+    uint64_t weight = sched_weight(priority);
+    if (thread->state == TASK_RUNNABLE)
+        rq->load += weight - thread->weight;
+    thread->weight = weight;
+
+    spinlock_release(&rq->lock);
+    interrupts_restore(rflags);
+}
+
+/* Change the CPUs a thread may run on. A waiting thread is moved off a CPU
+ * it is no longer allowed on right away, a running one is preempted and
+ * moved when it is put back, and a sleeping one when it wakes up. */
+void sched_set_affinity(struct thread_t *thread, const struct cpumask_t *mask) {
+    uint64_t rflags = interrupts_save();
+
+    for (;;) {
+        struct run_queue_t *rq = lock_thread_rq(thread);
+        thread->affinity = *mask;
+
+        int cpu = thread->cpu;
+        int done = 1;
+        if (!cpumask_test(mask, cpu)) {
+            switch (thread->state) {
+                case TASK_RUNNABLE: {
+                    int target = least_loaded_cpu(thread);
+                    if (target == -1)
+                        break;
+                    rq_remove(rq, thread);
+                    if (!push_other(rq, thread, target)) {
+                        rq_push(rq, thread);
+                        done = 0;
+                    }
+                    break;
+                }
+                case TASK_RUNNING:
+                    if (cpu == current_cpu)
+                        lapic_send_self_ipi(IPI_RESCHED);
+                    else
+                        lapic_send_ipi(IPI_RESCHED, cpu_locals[cpu].lapic_id);
+                    break;
+            }
+        }
+
+        spinlock_release(&rq->lock);
+        if (done)
+            break;
+        /* The target queue was busy, let go of ours and try again */
+        asm volatile ("pause");
+    }
+
+    interrupts_restore(rflags);
+}
+
+/* Whether the context a thread was switched away with is in user mode,
+ * where it holds no kernel locks and can be stopped for good */
+#define in_user_mode(thread) ((thread)->ctx.cs & 3)
+
+/* Mark a thread as exiting. It leaves its CPU for good and goes to the
+ * reaper at its next safe point, when it is preempted in user mode or
+ * about to run with its context there. A waiting thread whose context is
+ * in user mode goes right away, the CPU of a running one is preempted. */
+void sched_kill(struct thread_t *thread) {
+    uint64_t rflags = interrupts_save();
+    struct run_queue_t *rq = lock_thread_rq(thread);
+
+    thread->exiting = 1;
+
+    switch (thread->state) {
+        case TASK_RUNNABLE:
+            if (in_user_mode(thread)) {
+                rq_remove(rq, thread);
+                thread->state = TASK_DEAD;
+                task_reap(thread);
+            }
+            break;
+        case TASK_RUNNING:
+            if (thread->cpu == current_cpu)
+                lapic_send_self_ipi(IPI_RESCHED);
+            else
+                lapic_send_ipi(IPI_RESCHED, cpu_locals[thread->cpu].lapic_id);
+            break;
+    }
+
+    spinlock_release(&rq->lock);
+    interrupts_restore(rflags);
+}
+
+/* Take the thread this CPU is running off it for good, and hand it to the
+ * reaper. For a thread exiting on its own, which must not touch its kernel
+ * stack or its address space afterwards. Interrupts should be OFF */
+void sched_exit(void) {
+    struct run_queue_t *rq = &cpu_locals[current_cpu].run_queue;
+
+    spinlock_acquire(&rq->lock);
+    struct thread_t *thread = rq->current;
+    rq->current = NULL;
+    thread->state = TASK_DEAD;
+    task_reap(thread);
+    spinlock_release(&rq->lock);
+}
+
+/* Account the time the thread this CPU was running ran for, put it back on
+ * the queue, or to sleep if it yielded, wake up the sleepers which are
+ * due, and pick the next thread to run. Killed threads at a safe point go
+ * to the reaper instead, see sched_kill(). The timer is set for the end of
+ * its timeslice, or the next slot of the wheel due. An idle CPU with no
+ * sleepers takes no timer interrupts. Called by task_resched() with
+ * interrupts disabled, once it saved the context of the thread. */
+/* Returns the thread to run, NULL if there is none */
+struct thread_t *sched_switch(void) {
+    int self = current_cpu;
+    struct run_queue_t *rq = &cpu_locals[self].run_queue;
+
+    spinlock_acquire(&rq->lock);
+
+    uint64_t now_us = uptime_us();
+    uint64_t now = now_us / 1000;
+
+    wheel_advance(rq, now);
+
+    struct thread_t *prev = rq->current;
+    if (prev && prev->state == TASK_RUNNING) {
+        prev->vruntime += (now_us - prev->exec_start) * NICE_0_WEIGHT / prev->weight;
+        prev->runtime += now_us - prev->exec_start;
+        prev->last_ran = now;
+        if (prev->exiting && in_user_mode(prev)) {
+            prev->state = TASK_DEAD;
+            task_reap(prev);
+        } else {
+            wheel_insert(rq, prev);
+        }
+    }
+
+    if (smp_cpu_count > 1)
+        balance(rq, self);
+
+    /* min_vruntime only moves forward, it is where new threads start */
+    struct thread_t *first = tree_min(rq->root);
+    if (first && first->vruntime > rq->min_vruntime)
+        rq->min_vruntime = first->vruntime;
+
+    struct thread_t *next;
+    while ((next = rq_pop(rq, self)) && next->exiting && in_user_mode(next)) {
+        next->state = TASK_DEAD;
+        task_reap(next);
+    }
+    if (next) {
+        next->state = TASK_RUNNING;
+        next->exec_start = now_us;
+    }
+    rq->current = next;
+
+    uint64_t deadline = 0;
+    if (next)
+        deadline = now + timeslice(rq, next);
+    uint64_t wakeup = wheel_next(&rq->wheel);
+    if (wakeup && (!deadline || wakeup < deadline))
+        deadline = wakeup;
+
+    int waiting = rq->root != NULL;
+
+    spinlock_release(&rq->lock);
+
+    timer_set(deadline);
+
+    if (waiting && smp_cpu_count > 1)
+        kick_idle_cpu(self);
+
+    return next;
+}
+
+void sched_report(void) {
+    for (int i = 0; i < smp_cpu_count; i++) {
+        struct run_queue_t *rq = &cpu_locals[i].run_queue;
+        kprint(KPRN_INFO, "sched: CPU #%u: %U migrations, %U of them steals",
+               i, rq->nr_migrations, rq->nr_steals);
+    }
+}
+
+/* Wakeup latency benchmark: a thread sleeps BENCH_SLEEP_MS at a time, and
+ * measures how late it gets back on a CPU, while CPU-bound threads keep
+ * every CPU busy */
+#define BENCH_SLEEP_MS 10
+#define BENCH_WAKEUPS 100
+
+static volatile int bench_done;
+static uint64_t bench_total_us;
+static uint64_t bench_max_us;
+/* Kernel threads cannot be killed, the bench threads exit when told to */
+static volatile int bench_stop;
+static lock_t bench_exited;
+
+static void bench_exit(void) {
+    spinlock_inc(&bench_exited);
+    task_texit();
+}
+
+static void *bench_spinner(void *arg) {
+    (void)arg;
+
+    while (!bench_stop)
+        asm volatile ("pause");
+
+    bench_exit();
+
+    /* Not reached */
+    return NULL;
+}
+
+static void *bench_sleeper(void *arg) {
+    (void)arg;
+
+    for (int i = 0; i < BENCH_WAKEUPS; i++) {
+        uint64_t deadline = uptime_raw + BENCH_SLEEP_MS;
+        task_sleep_until(deadline);
+
+        uint64_t late_us = uptime_us() - deadline * 1000;
+        bench_total_us += late_us;
+        if (late_us > bench_max_us)
+            bench_max_us = late_us;
+    }
+
+    bench_done = 1;
+
+    bench_exit();
+
+    /* Not reached */
+    return NULL;
+}
+
+static void bench_wakeup_latency(int spinners) {
+    bench_done = 0;
+    bench_total_us = 0;
+    bench_max_us = 0;
+    bench_stop = 0;
+    bench_exited = 0;
+
+    int started = 0;
+    for (int i = 0; i < spinners; i++) {
+        if (task_tcreate(0, bench_spinner, 0) != -1)
+            started++;
+    }
+    if (task_tcreate(0, bench_sleeper, 0) != -1)
+        started++;
+    else
+        bench_done = 1;
+
+    while (!bench_done)
+        ksleep(BENCH_SLEEP_MS);
+
+    /* Wait for the threads to be gone before the next run */
+    bench_stop = 1;
+    while (bench_exited != started)
+        ksleep(BENCH_SLEEP_MS);
+
+    kprint(KPRN_INFO, "sched: bench: %u CPU-bound threads: wakeup latency %U us average, %U us max",
+           spinners, bench_total_us / BENCH_WAKEUPS, bench_max_us);
+}
+
+/* CPU share benchmark: CPU-bound threads of different priorities share a
+ * CPU for BENCH_SHARE_MS, and the share of the time each one ran for is
+ * compared to the share its weight entitles it to */
+#define BENCH_SHARE_MS 2000
+
+static const int bench_prios[] = { -5, 0, 5 };
+#define BENCH_PRIOS (sizeof(bench_prios) / sizeof(bench_prios[0]))
+
+static void bench_cpu_share(void) {
+    struct thread_t *threads[BENCH_PRIOS];
+    uint64_t runtime[BENCH_PRIOS];
+    uint64_t total_runtime = 0;
+    uint64_t total_weight = 0;
+
+    /* The last CPU, away from whatever the kernel threads are doing */
+    struct cpumask_t mask = {0};
+    cpumask_set(&mask, smp_cpu_count - 1);
+
+    bench_stop = 0;
+    bench_exited = 0;
+
+    int started = 0;
+    for (size_t i = 0; i < BENCH_PRIOS; i++) {
+        threads[i] = NULL;
+        tid_t tid = task_tcreate(0, bench_spinner, 0);
+        if (tid == -1)
+            continue;
+        started++;
+        task_setaffinity(0, tid, &mask);
+        /* Kernel threads all belong to process 0, the priorities are set
+         * on the threads themselves */
+        threads[i] = process_table[0]->threads[tid];
+        sched_set_priority(threads[i], bench_prios[i]);
+    }
+
+    /* Let the threads gather on the CPU first */
+    ksleep(BENCH_SLEEP_MS);
+    for (size_t i = 0; i < BENCH_PRIOS; i++)
+        runtime[i] = threads[i] ? threads[i]->runtime : 0;
+
+    ksleep(BENCH_SHARE_MS);
+
+    for (size_t i = 0; i < BENCH_PRIOS; i++) {
+        if (!threads[i])
+            continue;
+        runtime[i] = threads[i]->runtime - runtime[i];
+        total_runtime += runtime[i];
+        total_weight += sched_weight(bench_prios[i]);
+    }
+
+    for (size_t i = 0; i < BENCH_PRIOS && total_runtime; i++) {
+        if (!threads[i])
+            continue;
+        int prio = bench_prios[i];
+        kprint(KPRN_INFO, "sched: bench: priority %s%u: ran %U us, %U/1000 of the CPU, expected %U/1000",
+               prio < 0 ? "-" : "", prio < 0 ? -prio : prio, runtime[i],
+               runtime[i] * 1000 / total_runtime,
+               sched_weight(prio) * 1000 / total_weight);
+    }
+
+    bench_stop = 1;
+    while (bench_exited != started)
+        ksleep(BENCH_SLEEP_MS);
+}
+
+/* Run by the main kernel thread, with the scheduler running */
+void sched_bench(void) {
+    bench_wakeup_latency(0);
+    bench_wakeup_latency(smp_cpu_count);
+    bench_wakeup_latency(smp_cpu_count * 2);
+    bench_cpu_share();
+}
@@ -12,8 +12,11 @@
 #include <fs.h>
 #include <time.h>
 #include <pit.h>
-
-#define SMP_TIMESLICE_MS 5
+#include <slab.h>
+#include <tlb.h>
+#include <vma.h>
+#include <sched.h>
+#include <shm.h>
 
 void task_spinup(void *, size_t);
 
@@ -22,9 +25,58 @@ lock_t scheduler_lock = 0;
 struct process_t **process_table;
 
 struct thread_t **task_table;
-static int64_t task_count = 0;
 
-static lock_t switched_cpus = 0;
+/* Slots of the process table, the task table and the thread tables of the
+ * processes are claimed under this lock, and hold CLAIMED until what they
+ * were claimed for is set up. Everything else treats CLAIMED like EMPTY. */
+static lock_t tables_lock = 1;
+
+#define CLAIMED ((void *)(size_t)(-2))
+
+/* Claim the first free slot of `table`, of `size` slots */
+/* Returns the index of the slot, -1 if there is none */
+static int claim_slot(void **table, int size) {
+    int ret = -1;
+
+    uint64_t rflags = interrupts_save();
+    spinlock_acquire(&tables_lock);
+
+    for (int i = 0; i < size; i++) {
+        if (!table[i] || table[i] == EMPTY) {
+            table[i] = CLAIMED;
+            ret = i;
+            break;
+        }
+    }
+
+    spinlock_release(&tables_lock);
+    interrupts_restore(rflags);
+    return ret;
+}
+
+/* Fill in a claimed slot, once what goes in it is set up */
+static void publish_slot(void **slot, void *ptr) {
+    asm volatile ("" ::: "memory");
+    *(void * volatile *)slot = ptr;
+}
+
+/* Fill in the claimed slots of a new thread of `process`, and make it
+ * runnable. A thread of a process which got killed meanwhile is killed
+ * with it. */
+static void start_thread(struct process_t *process, struct thread_t *thread) {
+    uint64_t rflags = interrupts_save();
+    spinlock_acquire(&tables_lock);
+
+    thread->exiting = 0;
+    publish_slot((void **)&process->threads[thread->tid], thread);
+    publish_slot((void **)&task_table[thread->task_id], thread);
+    sched_add(thread);
+    if (process->exiting)
+        sched_kill(thread);
+
+    spinlock_release(&tables_lock);
+    interrupts_restore(rflags);
+}
 
 /* These represent the default new-thread register contexts for kernel space and
  * userspace. See kernel/include/ctx.h for the register order. */
@@ -33,11 +85,26 @@ static struct ctx_t default_usr_ctx = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x23,0x20
 
 static uint8_t default_fxstate[512];
 
+static struct slab_cache_t *thread_cache;
+static struct slab_cache_t *process_cache;
+static struct slab_cache_t *file_handles_cache;
+static struct slab_cache_t *shm_handles_cache;
+
+static void *reaper(void *);
+
 void init_sched(void) {
     fxsave(&default_fxstate);
 
     kprint(KPRN_INFO, "sched: Initialising process table...");
 
+    thread_cache = slab_cache_create("thread", sizeof(struct thread_t));
+    process_cache = slab_cache_create("process", sizeof(struct process_t));
+    file_handles_cache = slab_cache_create("file_handles", MAX_FILE_HANDLES * sizeof(int));
+    shm_handles_cache = slab_cache_create("shm_handles", MAX_SHM_HANDLES * sizeof(int));
+    if (!thread_cache || !process_cache || !file_handles_cache || !shm_handles_cache) {
+        panic("sched: Unable to create object caches.", 0, 0);
+    }
+
     /* Make room for task table */
     if ((task_table = kalloc(MAX_TASKS * sizeof(struct thread_t *))) == 0) {
         panic("sched: Unable to allocate task table.", 0, 0);
@@ -47,7 +114,7 @@ void init_sched(void) {
     }
     /* Now make space for PID 0 */
     kprint(KPRN_INFO, "sched: Creating PID 0");
-    if ((process_table[0] = kalloc(sizeof(struct process_t))) == 0) {
+    if ((process_table[0] = slab_alloc(process_cache)) == 0) {
         panic("sched: Unable to allocate space for kernel task", 0, 0);
     }
     if ((process_table[0]->threads = kalloc(MAX_THREADS * sizeof(struct thread_t *))) == 0) {
@@ -55,77 +122,57 @@ void init_sched(void) {
     }
     process_table[0]->pagemap = &kernel_pagemap;
     process_table[0]->pid = 0;
+    process_table[0]->priority = 0;
+    process_table[0]->exiting = 0;
+    cpumask_fill(&process_table[0]->affinity);
+
+    if (task_tcreate(0, reaper, 0) == -1) {
+        panic("sched: Unable to start the reaper thread.", 0, 0);
+    }
 
     kprint(KPRN_INFO, "sched: Init done.");
 
     return;
 }
 
-void yield(uint64_t ms) {
-    spinlock_acquire(&scheduler_lock);
+/* Put the calling thread to sleep until `deadline`, in milliseconds of
+ * uptime. The CPU runs other threads meanwhile. */
+/* Returns -1 if there is no thread to put to sleep, or the scheduler can't
+ * switch away from it: interrupts are disabled or the scheduler locked */
+int task_sleep_until(uint64_t deadline) {
+    uint64_t rflags = interrupts_save();
 
-    uint64_t yield_target = (uptime_raw + (ms * (PIT_FREQUENCY / 1000))) + 1;
+    struct thread_t *thread = cpu_locals[current_cpu].run_queue.current;
+    if (!thread || !(rflags & 0x200) || !scheduler_lock) {
+        interrupts_restore(rflags);
+        return -1;
+    }
 
-    tid_t current_task = cpu_locals[current_cpu].current_task;
-    task_table[current_task]->yield_target = yield_target;
+    thread->yield_target = deadline;
 
-    /* Send resched IPI to CPU 0 to trigger a reschedule */
-    lapic_write(APICREG_ICR1, ((uint32_t)cpu_locals[0].lapic_id) << 24);
-    lapic_write(APICREG_ICR0, IPI_RESCHED);
+    /* The CPU switches away as soon as interrupts are back on, and the
+     * thread goes into the timer wheel */
+    lapic_send_self_ipi(IPI_RESCHED);
 
-    /* Paranoia: make sure the IPI goes through, 1ms should be more than plenty */
-    ksleep(1);
+    interrupts_restore(rflags);
+    return 0;
 }
 
-/* Search for a new task to run */
-static inline tid_t task_get_next(tid_t current_task) {
-    if (current_task != -1) {
-        current_task++;
-    } else {
-        current_task = 0;
-    }
-
-    for (int64_t i = 0; i < task_count; ) {
-        struct thread_t *thread = task_table[current_task];
-        if (!thread) {
-            /* End of task table, rewind */
-            current_task = 0;
-            thread = task_table[current_task];
-        }
-        if (thread == EMPTY) {
-            /* This is an empty thread, skip */
-            goto skip;
-        }
-        if (thread->yield_target > uptime_raw) {
-            goto next;
-        }
-        if (!spinlock_test_and_acquire(&thread->lock)) {
-            /* If unable to acquire the thread's lock, skip */
-            goto next;
-        }
-        return current_task;
-        next:
-        i++;
-        skip:
-        if (++current_task == MAX_TASKS)
-            current_task = 0;
-    }
-
-    return -1;
+void yield(uint64_t ms) {
+    task_sleep_until((uptime_raw + (ms * (PIT_FREQUENCY / 1000))) + 1);
 }
 
 __attribute__((noinline)) static void _idle(void) {
     cpu_locals[current_cpu].current_task = -1;
     cpu_locals[current_cpu].current_thread = -1;
     cpu_locals[current_cpu].current_process = -1;
-    spinlock_inc(&switched_cpus);
-    while (spinlock_read(&switched_cpus) < smp_cpu_count);
-    if (!current_cpu) {
-        spinlock_release(&scheduler_lock);
-    }
     asm volatile (
         "call lapic_eoi;"
         "sti;"
+    );
+    /* Use the idle time to replenish the pool of zeroed pages */
+    pmm_zero_idle();
+    asm volatile (
         "1: "
         "hlt;"
         "jmp 1b;"
@@ -133,114 +180,80 @@ __attribute__((noinline)) static void _idle(void) {
 }
 
 __attribute__((noinline)) static void idle(void) {
+    size_t cr3 = 0;
+    if (cpu_locals[current_cpu].active_pagemap != &kernel_pagemap)
+        cr3 = tlb_switch_cr3(&kernel_pagemap);
+
     /* This idle function swaps cr3 and rsp then calls _idle for technical reasons */
     asm volatile (
-        "mov rbx, cr3;"
-        "cmp rax, rbx;"
-        "je 1f;"
+        "test rax, rax;"
+        "jz 1f;"
         "mov cr3, rax;"
         "1: "
         "mov rsp, qword ptr gs:[8];"
         "call _idle;"
         :
-        : "a" ((size_t)kernel_pagemap.pml4 - MEM_PHYS_OFFSET)
+        : "a" (cr3)
     );
     /* Dead call so GCC doesn't garbage collect _idle */
     _idle();
 }
 
 void task_resched(struct ctx_t *ctx) {
-    pid_t current_task = cpu_locals[current_cpu].current_task;
-    pid_t last_task = current_task;
+    struct cpu_local_t *cpu_local = &cpu_locals[current_cpu];
+    struct thread_t *current_thread = cpu_local->run_queue.current;
 
-    if (current_task != -1) {
-        struct thread_t *current_thread = task_table[current_task];
+    if (current_thread) {
         /* Save current context */
-        current_thread->active_on_cpu = -1;
         current_thread->ctx = *ctx;
         /* Save FPU context */
         fxsave(&current_thread->fxstate);
         /* Save user rsp */
-        current_thread->ustack = cpu_locals[current_cpu].thread_ustack;
-        /* Release lock on this thread */
-        spinlock_release(&current_thread->lock);
+        current_thread->ustack = cpu_local->thread_ustack;
     }
 
     /* Get to the next task */
-    current_task = task_get_next(current_task);
+    struct thread_t *thread = sched_switch();
     /* If there's nothing to do, idle */
-    if (current_task == -1)
+    if (!thread)
         idle();
 
-    struct cpu_local_t *cpu_local = &cpu_locals[current_cpu];
-    struct thread_t *thread = task_table[current_task];
-
-    cpu_local->current_task = current_task;
+    cpu_local->current_task = thread->task_id;
     cpu_local->current_thread = thread->tid;
     cpu_local->current_process = thread->process;
 
     cpu_local->thread_kstack = thread->kstack;
     cpu_local->thread_ustack = thread->ustack;
 
-    thread->active_on_cpu = current_cpu;
-
     /* Restore FPU context */
     fxrstor(&thread->fxstate);
 
     /* Restore thread FS base */
     load_fs_base(thread->fs_base);
 
-    spinlock_inc(&switched_cpus);
-    while (spinlock_read(&switched_cpus) < smp_cpu_count);
-    if (!current_cpu) {
-        spinlock_release(&scheduler_lock);
-    }
-
     /* Swap cr3, if necessary */
-    if (task_table[last_task]->process != thread->process) {
+    struct pagemap_t *pagemap = process_table[thread->process]->pagemap;
+    if (cpu_local->active_pagemap != pagemap) {
         /* Switch cr3 and return to the thread */
-        task_spinup(&thread->ctx, (size_t)process_table[thread->process]->pagemap->pml4 - MEM_PHYS_OFFSET);
+        task_spinup(&thread->ctx, tlb_switch_cr3(pagemap));
     } else {
         /* Don't switch cr3 and return to the thread */
         task_spinup(&thread->ctx, 0);
     }
 }
 
-static int pit_ticks = 0;
+/* Called by the local APIC timer and IPI_RESCHED stubs */
+void task_preempt(struct ctx_t *ctx) {
+    /* Whatever the timer was set for is due, or about to be reset */
+    cpu_locals[current_cpu].timer_deadline = 0;
 
-void task_resched_bsp(struct ctx_t *ctx) {
-    /* Assert lock on the scheduler */
-    if (!spinlock_test_and_acquire(&scheduler_lock)) {
+    /* Locked by panics, and while the scheduler is not ready. Try again
+     * later, wakeups sent meanwhile were lost. */
+    if (!scheduler_lock) {
+        timer_set(uptime_raw + SCHED_TIMESLICE_MS);
         return;
     }
 
-    if (++pit_ticks == SMP_TIMESLICE_MS) {
-        pit_ticks = 0;
-    } else {
-        spinlock_release(&scheduler_lock);
-        return;
-    }
-
-    spinlock_test_and_acquire(&switched_cpus);
-
-    for (int i = 1; i < smp_cpu_count; i++) {
-        lapic_write(APICREG_ICR1, ((uint32_t)cpu_locals[i].lapic_id) << 24);
-        lapic_write(APICREG_ICR0, IPI_RESCHED);
-    }
-
-    /* Call task_scheduler on the BSP */
-    task_resched(ctx);
-}
-
-void task_trigger_resched(struct ctx_t *ctx) {
-    spinlock_test_and_acquire(&switched_cpus);
-
-    for (int i = 1; i < smp_cpu_count; i++) {
-        lapic_write(APICREG_ICR1, ((uint32_t)cpu_locals[i].lapic_id) << 24);
-        lapic_write(APICREG_ICR0, IPI_RESCHED);
-    }
-
-    /* Call task_scheduler on the BSP */
     task_resched(ctx);
 }
 
@@ -249,39 +262,45 @@ void task_trigger_resched(struct ctx_t *ctx) {
 /* Create process */
 /* Returns process ID, -1 on failure */
 pid_t task_pcreate(struct pagemap_t *pagemap) {
-    /* Search for free process ID */
-    pid_t new_pid;
-    for (new_pid = 0; new_pid < MAX_PROCESSES - 1; new_pid++) {
-        if (!process_table[new_pid] || process_table[new_pid] == (void *)(-1))
-            goto found_new_pid;
-    }
-    return -1;
+    /* Claim a free process ID */
+    pid_t new_pid = claim_slot((void **)process_table, MAX_PROCESSES - 1);
+    if (new_pid == -1)
+        return -1;
 
-found_new_pid:
     /* Try to make space for this new task */
-    if ((process_table[new_pid] = kalloc(sizeof(struct process_t))) == 0) {
+    struct process_t *new_process;
+    if ((new_process = slab_alloc(process_cache)) == 0) {
         process_table[new_pid] = EMPTY;
         return -1;
     }
 
-    struct process_t *new_process = process_table[new_pid];
-
     if ((new_process->threads = kalloc(MAX_THREADS * sizeof(struct thread_t *))) == 0) {
-        kfree(new_process);
+        slab_free(new_process);
         process_table[new_pid] = EMPTY;
         return -1;
     }
 
-    if ((new_process->file_handles = kalloc(MAX_FILE_HANDLES * sizeof(int))) == 0) {
+    if ((new_process->file_handles = slab_alloc(file_handles_cache)) == 0) {
         kfree(new_process->threads);
-        kfree(new_process);
+        slab_free(new_process);
+        process_table[new_pid] = EMPTY;
+        return -1;
+    }
+
+    if ((new_process->shm_handles = slab_alloc(shm_handles_cache)) == 0) {
+        slab_free(new_process->file_handles);
+        kfree(new_process->threads);
+        slab_free(new_process);
         process_table[new_pid] = EMPTY;
         return -1;
     }
 
     /* Initially, mark all file handles as unused */
     for (size_t i = 0; i < MAX_FILE_HANDLES; i++) {
-        process_table[new_pid]->file_handles[i] = -1;
+        new_process->file_handles[i] = -1;
+    }
+    for (size_t i = 0; i < MAX_SHM_HANDLES; i++) {
+        new_process->shm_handles[i] = -1;
     }
 
     /* Map the higher half into the process */
@@ -293,79 +312,419 @@ found_new_pid:
 
     new_process->pagemap = pagemap;
     new_process->pid = new_pid;
+    new_process->priority = 0;
+    new_process->exiting = 0;
+    cpumask_fill(&new_process->affinity);
+
+    publish_slot((void **)&process_table[new_pid], new_process);
 
     return new_pid;
 }
 
-/* Kill a thread in a given process */
+/* Count the threads of a process, those being created included. tables_lock
+ * must be held. */
+static size_t thread_count(struct process_t *process) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < MAX_THREADS; i++) {
+        struct thread_t *thread = process->threads[i];
+        if (thread && thread != (void *)(-1))
+            count++;
+    }
+
+    return count;
+}
+
+/* Kill a thread in a given process. It leaves at its next safe point, see
+ * sched_kill(). Kernel threads are never in user mode, they leave on their
+ * own with task_texit(). */
 /* Return -1 on failure */
 int task_tkill(pid_t pid, tid_t tid) {
-    if (!process_table[pid]->threads[tid] || process_table[pid]->threads[tid] == (void *)(-1)) {
+    if (pid <= 0 || pid >= MAX_PROCESSES || tid < 0 || tid >= MAX_THREADS)
         return -1;
+
+    int ret = -1;
+
+    uint64_t rflags = interrupts_save();
+    spinlock_acquire(&tables_lock);
+
+    struct process_t *process = process_table[pid];
+    if (!process || process == (void *)(-1) || process == CLAIMED)
+        goto out;
+
+    struct thread_t *thread = process->threads[tid];
+    if (!thread || thread == (void *)(-1) || thread == CLAIMED)
+        goto out;
+
+    if (thread->task_id == cpu_locals[current_cpu].current_task) {
+        panic("thread killing self isn't allowed", 0, 0);
+    }
+
+    sched_kill(thread);
+    ret = 0;
+
+out:
+    spinlock_release(&tables_lock);
+    interrupts_restore(rflags);
+    return ret;
+}
+
+/* Free a process whose threads are all gone, and everything it owns */
+static void task_pfree(pid_t pid) {
+    struct process_t *process = process_table[pid];
+
+    /* Every CPU which ran the process has switched away from it */
+    for (int i = 0; i < smp_cpu_count; i++) {
+        while (*(struct pagemap_t * volatile *)&cpu_locals[i].active_pagemap == process->pagemap) {
+            tlb_serve_pending();
+            asm volatile ("pause");
+        }
     }
 
-    int active_on_cpu = process_table[pid]->threads[tid]->active_on_cpu;
+    for (size_t i = 0; i < MAX_FILE_HANDLES; i++) {
+        if (process->file_handles[i] != -1)
+            close(process->file_handles[i]);
+    }
 
-    if (active_on_cpu != -1 && active_on_cpu != current_cpu) {
-        /* Send abort execution IPI */
-        lapic_write(APICREG_ICR1, ((uint32_t)cpu_locals[active_on_cpu].lapic_id) << 24);
-        lapic_write(APICREG_ICR0, IPI_ABORTEXEC);
+    /* The segments' pages mapped by the process go with its pagemap */
+    for (size_t i = 0; i < MAX_SHM_HANDLES; i++) {
+        if (process->shm_handles[i] != -1)
+            shm_close(process->shm_handles[i]);
     }
 
-    kfree(process_table[pid]->threads[tid]);
+    vma_destroy(process->pagemap);
+
+    slab_free(process->file_handles);
+    slab_free(process->shm_handles);
+    kfree(process->threads);
+    slab_free(process);
+
+    process_table[pid] = EMPTY;
+}
+
+/* Threads which left their CPU for good, linked by `next`, for the reaper
+ * to free */
+static struct thread_t *dead_threads = NULL;
+static lock_t dead_threads_lock = 1;
 
-    process_table[pid]->threads[tid] = EMPTY;
+#define REAPER_INTERVAL_MS 10
+
+/* Hand a thread which left its CPU for good to the reaper. Called by the
+ * scheduler, with interrupts disabled. */
+void task_reap(struct thread_t *thread) {
+    spinlock_acquire(&dead_threads_lock);
+    thread->next = dead_threads;
+    dead_threads = thread;
+    spinlock_release(&dead_threads_lock);
+}
 
-    task_count--;
+/* Free a dead thread, and its process along with the last thread of it if
+ * the process was killed */
+static void free_thread(struct thread_t *thread) {
+    pid_t pid = thread->process;
+    struct process_t *process = process_table[pid];
 
-    if (active_on_cpu != -1) {
-        cpu_locals[active_on_cpu].current_process = -1;
-        cpu_locals[active_on_cpu].current_thread = -1;
-        if (active_on_cpu == current_cpu) {
-            panic("thread killing self isn't allowed", 0, 0);
+    uint64_t rflags = interrupts_save();
+    spinlock_acquire(&tables_lock);
+
+    task_table[thread->task_id] = EMPTY;
+    process->threads[thread->tid] = EMPTY;
+    int last = process->exiting && !thread_count(process);
+
+    spinlock_release(&tables_lock);
+    interrupts_restore(rflags);
+
+    slab_free(thread);
+
+    if (last)
+        task_pfree(pid);
+}
+
+/* Kernel thread freeing the threads which died, and the processes which
+ * went with them. This takes locks which may not be taken with interrupts
+ * disabled, unlike where threads die. */
+static void *reaper(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        uint64_t rflags = interrupts_save();
+        spinlock_acquire(&dead_threads_lock);
+        struct thread_t *thread = dead_threads;
+        dead_threads = NULL;
+        spinlock_release(&dead_threads_lock);
+        interrupts_restore(rflags);
+
+        while (thread) {
+            struct thread_t *next = thread->next;
+            free_thread(thread);
+            thread = next;
         }
+
+        yield(REAPER_INTERVAL_MS);
+    }
+
+    /* Not reached */
+    return NULL;
+}
+
+/* Kill the threads of a process but the calling one, see sched_kill().
+ * The process is freed along with the last one. */
+/* Returns the number of threads the process has, -1 if it was killed
+ * already */
+static int task_kill_threads(struct process_t *process) {
+    tid_t current_task = cpu_locals[current_cpu].current_task;
+    int count = -1;
+
+    uint64_t rflags = interrupts_save();
+    spinlock_acquire(&tables_lock);
+
+    if (process->exiting)
+        goto out;
+    process->exiting = 1;
+
+    for (size_t i = 0; i < MAX_THREADS; i++) {
+        struct thread_t *thread = process->threads[i];
+        if (!thread || thread == (void *)(-1) || thread == CLAIMED
+         || thread->task_id == current_task)
+            continue;
+        sched_kill(thread);
+    }
+
+    count = thread_count(process);
+
+out:
+    spinlock_release(&tables_lock);
+    interrupts_restore(rflags);
+    return count;
+}
+
+/* Kill a process other than the calling one. Its threads leave at their
+ * next safe point, and its address space, kernel stacks included, and its
+ * file handles are freed along with the last one. */
+/* Return -1 on failure */
+int task_pkill(pid_t pid) {
+    if (pid <= 0 || pid >= MAX_PROCESSES || pid == cpu_locals[current_cpu].current_process)
+        return -1;
+
+    struct process_t *process = process_table[pid];
+    if (!process || process == (void *)(-1) || process == CLAIMED)
+        return -1;
+
+    int count = task_kill_threads(process);
+    if (count == -1)
+        return -1;
+
+    /* No thread is left to free it along with */
+    if (!count)
+        task_pfree(pid);
+
+    return 0;
+}
+
+/* The second half of task_texit(), running on the CPU's own stack rather
+ * than the kernel stack of the exiting thread, which gets freed */
+__attribute__((noinline)) static void _task_texit(void) {
+    struct cpu_local_t *cpu_local = &cpu_locals[current_cpu];
+
+    cpu_local->current_task = -1;
+    cpu_local->current_thread = -1;
+    cpu_local->current_process = -1;
+
+    if (cpu_local->active_pagemap != &kernel_pagemap)
+        load_cr3(tlb_switch_cr3(&kernel_pagemap));
+
+    /* The reaper may free the thread, and its process, from here on */
+    sched_exit();
+
+    /* Wait for the next reschedule, like an idle CPU */
+    asm volatile (
+        "sti;"
+        "1: "
+        "hlt;"
+        "jmp 1b;"
+    );
+}
+
+/* Terminate the calling thread. Does not return. */
+void task_texit(void) {
+    /* Nothing may interrupt the CPU on its own stack, the timer and
+     * IPI_RESCHED would restart it from the top */
+    asm volatile (
+        "cli;"
+        "mov rsp, qword ptr gs:[8];"
+        "call _task_texit;"
+    );
+    /* Dead call so GCC doesn't garbage collect _task_texit */
+    _task_texit();
+}
+
+/* Terminate the calling process. Called by a syscall. Does not return. */
+void task_pexit(void) {
+    struct process_t *process = process_table[cpu_locals[current_cpu].current_process];
+
+    /* The process is freed along with the last of its threads to leave,
+     * which may well be this one */
+    task_kill_threads(process);
+    task_texit();
+}
+
+/* Set the priority of a process, from SCHED_PRIO_MIN to SCHED_PRIO_MAX,
+ * which weighs its threads against the others when sharing a CPU */
+/* Return -1 on failure */
+int task_setpriority(pid_t pid, int priority) {
+    if (pid < 0 || pid >= MAX_PROCESSES)
+        return -1;
+    if (priority < SCHED_PRIO_MIN || priority > SCHED_PRIO_MAX)
+        return -1;
+
+    struct process_t *process = process_table[pid];
+    if (!process || process == (void *)(-1) || process == CLAIMED)
+        return -1;
+
+    process->priority = priority;
+
+    for (size_t i = 0; i < MAX_THREADS; i++) {
+        struct thread_t *thread = process->threads[i];
+        if (!thread || thread == (void *)(-1) || thread == CLAIMED)
+            continue;
+        sched_set_priority(thread, priority);
+    }
+
+    return 0;
+}
+
+/* The thread `tid` of process `pid`, NULL if there is none */
+static struct thread_t *get_thread(pid_t pid, tid_t tid) {
+    if (pid < 0 || pid >= MAX_PROCESSES)
+        return NULL;
+    if (tid < 0 || tid >= MAX_THREADS)
+        return NULL;
+
+    struct process_t *process = process_table[pid];
+    if (!process || process == (void *)(-1) || process == CLAIMED)
+        return NULL;
+
+    struct thread_t *thread = process->threads[tid];
+    if (!thread || thread == (void *)(-1) || thread == CLAIMED)
+        return NULL;
+
+    return thread;
+}
+
+/* Set the CPUs thread `tid` of a process may run on, or with `tid` -1 the
+ * ones of the process, which its new threads start with, and of all of
+ * its threads. The mask has to allow one of the CPUs there are. */
+/* Return -1 on failure */
+int task_setaffinity(pid_t pid, tid_t tid, const struct cpumask_t *mask) {
+    int allowed = 0;
+    for (int i = 0; i < smp_cpu_count; i++)
+        allowed |= cpumask_test(mask, i);
+    if (!allowed)
+        return -1;
+
+    if (tid != -1) {
+        struct thread_t *thread = get_thread(pid, tid);
+        if (!thread)
+            return -1;
+        sched_set_affinity(thread, mask);
+        return 0;
+    }
+
+    if (pid < 0 || pid >= MAX_PROCESSES)
+        return -1;
+
+    struct process_t *process = process_table[pid];
+    if (!process || process == (void *)(-1) || process == CLAIMED)
+        return -1;
+
+    process->affinity = *mask;
+
+    for (size_t i = 0; i < MAX_THREADS; i++) {
+        struct thread_t *thread = process->threads[i];
+        if (!thread || thread == (void *)(-1) || thread == CLAIMED)
+            continue;
+        sched_set_affinity(thread, mask);
     }
 
     return 0;
 }
 
+/* Get the CPUs thread `tid` of a process may run on, or with `tid` -1 the
+ * ones new threads of the process start with */
+/* Return -1 on failure */
+int task_getaffinity(pid_t pid, tid_t tid, struct cpumask_t *mask) {
+    if (tid != -1) {
+        struct thread_t *thread = get_thread(pid, tid);
+        if (!thread)
+            return -1;
+        *mask = thread->affinity;
+        return 0;
+    }
+
+    if (pid < 0 || pid >= MAX_PROCESSES)
+        return -1;
+
+    struct process_t *process = process_table[pid];
+    if (!process || process == (void *)(-1) || process == CLAIMED)
+        return -1;
+
+    *mask = process->affinity;
+    return 0;
+}
+
 #define KSTACK_LOCATION_TOP ((size_t)0x0000800000000000)
 #define KSTACK_SIZE ((size_t)32768)
 
 #define STACK_LOCATION_TOP ((size_t)0x0000700000000000)
 #define STACK_SIZE ((size_t)32768)
 
+static size_t kstack_bottom(tid_t tid) {
+    size_t kstack_guardpage = KSTACK_LOCATION_TOP -
+                              (KSTACK_SIZE + PAGE_SIZE/*guard page*/) * (tid + 1);
+    return kstack_guardpage + PAGE_SIZE;
+}
+
+/* Set up the kernel stack of thread `tid` of a process. Page faults and
+ * syscalls run on the kernel stack, so unlike the user stack it has to be
+ * backed up front. */
+/* Returns the top of the stack, 0 on failure */
+static size_t map_kstack(struct pagemap_t *pagemap, tid_t tid) {
+    void *ptr = pmm_alloc_flags(KSTACK_SIZE / PAGE_SIZE, PMM_NOZERO);
+    if (!ptr)
+        return 0;
+
+    /* The page below the stack is never mapped, it is the guard page */
+    if (map_range(pagemap, (size_t)ptr, kstack_bottom(tid), KSTACK_SIZE / PAGE_SIZE, 0x03)) {
+        unmap_range(pagemap, kstack_bottom(tid), KSTACK_SIZE / PAGE_SIZE);
+        pmm_free(ptr, KSTACK_SIZE / PAGE_SIZE);
+        return 0;
+    }
+
+    return kstack_bottom(tid) + KSTACK_SIZE;
+}
+
 /* Create thread from function pointer */
 /* Returns thread ID, -1 on failure */
 tid_t task_tcreate(pid_t pid, void *(*entry)(void *), void *arg) {
-    /* Search for free thread ID in the process */
-    tid_t new_tid;
-    for (new_tid = 0; new_tid < MAX_THREADS; new_tid++) {
-        if (!process_table[pid]->threads[new_tid] || process_table[pid]->threads[new_tid] == (void *)(-1))
-            goto found_new_tid;
-    }
-    return -1;
-found_new_tid:;
+    /* Claim a free thread ID in the process */
+    tid_t new_tid = claim_slot((void **)process_table[pid]->threads, MAX_THREADS);
+    if (new_tid == -1)
+        return -1;
 
-    /* Search for free global task ID */
-    tid_t new_task_id;
-    for (new_task_id = 0; new_task_id < MAX_TASKS; new_task_id++) {
-        if (!task_table[new_task_id] || task_table[new_tid] == (void *)(-1))
-            goto found_new_task_id;
+    /* Claim a free global task ID */
+    tid_t new_task_id = claim_slot((void **)task_table, MAX_TASKS);
+    if (new_task_id == -1) {
+        process_table[pid]->threads[new_tid] = EMPTY;
+        return -1;
     }
-    return -1;
-found_new_task_id:;
 
     /* Try to make space for this new thread */
     struct thread_t *new_thread;
-    if ((new_thread = kalloc(sizeof(struct thread_t))) == 0) {
-        return -1;
+    if ((new_thread = slab_alloc(thread_cache)) == 0) {
+        goto fail;
     }
 
-    process_table[pid]->threads[new_tid] = new_thread;
-    task_table[new_task_id] = new_thread;
-
-    new_thread->active_on_cpu = -1;
+    new_thread->task_id = new_task_id;
 
     /* Set registers to defaults */
     if (pid)
@@ -378,43 +737,35 @@ found_new_task_id:;
         size_t stack_guardpage = STACK_LOCATION_TOP -
                                  (STACK_SIZE + PAGE_SIZE/*guard page*/) * (new_tid + 1);
         size_t stack_bottom = stack_guardpage + PAGE_SIZE;
-        for (size_t i = 0; i < STACK_SIZE / PAGE_SIZE; i++) {
-            void *ptr = pmm_alloc(1);
+        /* The page below the stack is never mapped, it is the guard page */
+        if (pid) {
+            /* Backed on demand as the stack grows down towards the guard page */
+            if (vma_map(process_table[pid]->pagemap, stack_bottom, STACK_SIZE,
+                        PROT_READ | PROT_WRITE)) {
+                slab_free(new_thread);
+                goto fail;
+            }
+        } else {
+            /* Kernel threads run on this stack in ring 0, where a fault on
+             * the stack itself cannot be delivered */
+            void *ptr = pmm_alloc(STACK_SIZE / PAGE_SIZE);
             if (!ptr) {
-                kfree(process_table[pid]->threads[new_tid]);
-                process_table[pid]->threads[new_tid] = EMPTY;
-                return -1;
+                slab_free(new_thread);
+                goto fail;
             }
-            map_page(process_table[pid]->pagemap,
-                     (size_t)ptr,
-                     (size_t)(stack_bottom + (i * PAGE_SIZE)),
-                     pid ? 0x07 : 0x03);
+            map_range(process_table[pid]->pagemap, (size_t)ptr, stack_bottom,
+                      STACK_SIZE / PAGE_SIZE, 0x03);
         }
-        /* Add a guard page */
-        unmap_page(process_table[pid]->pagemap, stack_guardpage);
         new_thread->ctx.rsp = stack_bottom + STACK_SIZE;
     }
 
     /* Set up a kernel stack for the thread */
     if (pid) {
-        size_t kstack_guardpage = KSTACK_LOCATION_TOP -
-                                  (KSTACK_SIZE + PAGE_SIZE/*guard page*/) * (new_tid + 1);
-        size_t kstack_bottom = kstack_guardpage + PAGE_SIZE;
-        for (size_t i = 0; i < KSTACK_SIZE / PAGE_SIZE; i++) {
-            void *ptr = pmm_alloc(1);
-            if (!ptr) {
-                kfree(process_table[pid]->threads[new_tid]);
-                process_table[pid]->threads[new_tid] = EMPTY;
-                return -1;
-            }
-            map_page(process_table[pid]->pagemap,
-                     (size_t)ptr,
-                     (size_t)(kstack_bottom + (i * PAGE_SIZE)),
-                     0x03);
+        new_thread->kstack = map_kstack(process_table[pid]->pagemap, new_tid);
+        if (!new_thread->kstack) {
+            slab_free(new_thread);
+            goto fail;
         }
-        /* Add a guard page */
-        unmap_page(process_table[pid]->pagemap, kstack_guardpage);
-        new_thread->kstack = kstack_bottom + KSTACK_SIZE;
     }
 
     /* Set instruction pointer to entry point, and set first argument to arg */
@@ -427,9 +778,106 @@ found_new_task_id:;
 
     new_thread->tid = new_tid;
     new_thread->process = pid;
-    spinlock_release(&new_thread->lock);
+    new_thread->yield_target = 0;
+    new_thread->last_ran = 0;
+    new_thread->affinity = process_table[pid]->affinity;
 
-    task_count++;
+    start_thread(process_table[pid], new_thread);
 
     return new_tid;
+
+fail:
+    task_table[new_task_id] = EMPTY;
+    process_table[pid]->threads[new_tid] = EMPTY;
+    return -1;
+}
+
+/* Duplicate the calling process, sharing its pages copy-on-write. The new
+ * process gets a single thread, a copy of the calling one, which returns
+ * from the syscall with rax = 0. It keeps the same thread ID, so that its
+ * user stack is where the copy of the parent's is. */
+/* Returns the new process ID, -1 on failure */
+pid_t task_pfork(struct ctx_t *ctx) {
+    struct cpu_local_t *cpu_local = &cpu_locals[current_cpu];
+    struct process_t *parent = process_table[cpu_local->current_process];
+    struct thread_t *parent_thread = task_table[cpu_local->current_task];
+    tid_t tid = parent_thread->tid;
+
+    struct pagemap_t *pagemap = new_pagemap();
+    if (!pagemap)
+        return -1;
+
+    if (vma_fork(pagemap, parent->pagemap)) {
+        vma_destroy(pagemap);
+        return -1;
+    }
+
+    size_t kstack = map_kstack(pagemap, tid);
+    if (!kstack) {
+        vma_destroy(pagemap);
+        return -1;
+    }
+
+    /* Claim a free global task ID */
+    tid_t new_task_id = claim_slot((void **)task_table, MAX_TASKS);
+    if (new_task_id == -1) {
+        vma_destroy(pagemap);
+        return -1;
+    }
+
+    struct thread_t *new_thread;
+    if ((new_thread = slab_alloc(thread_cache)) == 0) {
+        task_table[new_task_id] = EMPTY;
+        vma_destroy(pagemap);
+        return -1;
+    }
+
+    pid_t new_pid = task_pcreate(pagemap);
+    if (new_pid == (pid_t)(-1)) {
+        slab_free(new_thread);
+        task_table[new_task_id] = EMPTY;
+        vma_destroy(pagemap);
+        return -1;
+    }
+
+    struct process_t *new_process = process_table[new_pid];
+
+    new_process->priority = parent->priority;
+    new_process->affinity = parent->affinity;
+    new_process->cur_brk = parent->cur_brk;
+    new_process->auxval = parent->auxval;
+    for (size_t i = 0; i < MAX_FILE_HANDLES; i++) {
+        if (parent->file_handles[i] != -1)
+            new_process->file_handles[i] = vfs_dup(parent->file_handles[i]);
+    }
+    for (size_t i = 0; i < MAX_SHM_HANDLES; i++) {
+        if (parent->shm_handles[i] != -1)
+            new_process->shm_handles[i] = shm_dup(parent->shm_handles[i]);
+    }
+
+    /* syscall_entry only saved the general purpose registers, the return
+     * address and flags are in rcx and r11 and the user stack is in the
+     * CPU local */
+    new_thread->ctx = default_usr_ctx;
+    kmemcpy(&new_thread->ctx, ctx, offsetof(struct ctx_t, rip));
+    new_thread->ctx.rax = 0;
+    new_thread->ctx.rip = ctx->rcx;
+    new_thread->ctx.rflags = ctx->r11;
+    new_thread->ctx.rsp = cpu_local->thread_ustack;
+
+    new_thread->kstack = kstack;
+    new_thread->ustack = cpu_local->thread_ustack;
+    fxsave(&new_thread->fxstate);
+    new_thread->fs_base = parent_thread->fs_base;
+
+    new_thread->tid = tid;
+    new_thread->task_id = new_task_id;
+    new_thread->process = new_pid;
+    new_thread->yield_target = 0;
+    new_thread->last_ran = 0;
+    new_thread->affinity = parent_thread->affinity;
+
+    start_thread(new_process, new_thread);
+
+    return new_pid;
 }